@@ -0,0 +1,97 @@
+#include "aes.h"
+
+#include  <cstdlib>
+#include  <cstring>
+#include  <openssl/evp.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include  <immintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+// next round key from the previous one k and t = AESKEYGENASSIST(k, rcon)
+__attribute__((target("aes")))
+static inline __m128i expand(__m128i k, __m128i t)
+{
+    t = _mm_shuffle_epi32(t, 0xFF);
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    return _mm_xor_si128(k, t);
+}
+
+// one round for all the keys of a group: their next round key, then the
+// round itself on their state (AESKEYGENASSIST takes the round constant
+// as an immediate, hence a macro)
+#define AES_ROUND(rcon, enc)                                               \
+    for (int j = 0; j < n; j++)                                            \
+    {                                                                      \
+        k[j] = expand(k[j], _mm_aeskeygenassist_si128(k[j], rcon));        \
+        s[j] = enc(s[j], k[j]);                                            \
+    }
+
+__attribute__((target("aes")))
+static int aes_verify_ni(const unsigned char (*keys)[16], int num, const unsigned char* m, const unsigned char* c)
+{
+    const __m128i mv = _mm_loadu_si128((const __m128i*) m);
+    const __m128i cv = _mm_loadu_si128((const __m128i*) c);
+
+    for (int i = 0; i < num; i += AES_BATCH)
+    {
+        int n = num - i < AES_BATCH ? num - i : AES_BATCH;
+
+        __m128i k[AES_BATCH], s[AES_BATCH];
+        for (int j = 0; j < n; j++)
+        {
+            k[j] = _mm_loadu_si128((const __m128i*) keys[i + j]);
+            s[j] = _mm_xor_si128(mv, k[j]);
+        }
+
+        AES_ROUND(0x01, _mm_aesenc_si128)
+        AES_ROUND(0x02, _mm_aesenc_si128)
+        AES_ROUND(0x04, _mm_aesenc_si128)
+        AES_ROUND(0x08, _mm_aesenc_si128)
+        AES_ROUND(0x10, _mm_aesenc_si128)
+        AES_ROUND(0x20, _mm_aesenc_si128)
+        AES_ROUND(0x40, _mm_aesenc_si128)
+        AES_ROUND(0x80, _mm_aesenc_si128)
+        AES_ROUND(0x1B, _mm_aesenc_si128)
+        AES_ROUND(0x36, _mm_aesenclast_si128)
+
+        for (int j = 0; j < n; j++)
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(s[j], cv)) == 0xFFFF)
+                return i + j;
+    }
+    return -1;
+}
+
+#undef AES_ROUND
+#endif
+
+int aes_verify(const unsigned char (*keys)[16], int num, const unsigned char* m, const unsigned char* c)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool aesni = __builtin_cpu_supports("aes");
+    if (aesni)
+        return aes_verify_ni(keys, num, m, c);
+#endif
+
+    // one context for the whole batch, keyed again for every candidate
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL || !EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL, NULL, NULL))
+        abort();
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+    int hit = -1;
+    for (int i = 0; i < num && hit < 0; i++)
+    {
+        unsigned char t[16];
+        int len;
+        if (!EVP_EncryptInit_ex(ctx, NULL, NULL, keys[i], NULL) || !EVP_EncryptUpdate(ctx, t, &len, m, 16))
+            abort();
+        if (!memcmp(t, c, 16))
+            hit = i;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return hit;
+}
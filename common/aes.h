@@ -0,0 +1,17 @@
+#ifndef __AES_H
+#define __AES_H
+
+// keys checked together by aes_verify(): with AES-NI their key schedules
+// and encryptions are interleaved, so that the latency of one AES round
+// is hidden behind the rounds of the others
+#define AES_BATCH 8
+
+// batch verification of AES-128 key candidates against one known
+// plaintext and ciphertext: the index of the first of the num keys
+// which encrypts m into c, -1 when none does
+// every key has its own schedule, expanded on the fly round by round
+// with AES-NI when the processor has it, with OpenSSL (EVP, AES-128-ECB) otherwise; num
+// may be anything, the keys are taken AES_BATCH at a time
+int aes_verify(const unsigned char (*keys)[16], int num, const unsigned char* m, const unsigned char* c);
+
+#endif
@@ -0,0 +1,375 @@
+#include "oracle.h"
+
+#include  <cstring>
+#include  <cstdint>
+#include  <fcntl.h>
+#include  <algorithm>
+#ifdef __SSE2__
+#include  <emmintrin.h>
+#endif
+
+using namespace std;
+
+target_t targets[TARGETS_MAX];
+int targets_num = 0;
+
+target_t replicas[TARGETS_MAX];
+int replicas_num = 0;
+
+const char* oracle_record_path = NULL;
+const char* oracle_replay_path = NULL;
+bool oracle_binary = false;
+size_t oracle_memory_budget = 0;
+
+int oracle_main(int argc, char* argv[], void (*attack)(char* argv2), int targets_max)
+{
+	return oracle_main(argc, argv, attack, [targets_max](const char*) { return targets_max; });
+}
+
+int oracle_main(int argc, char* argv[], void (*attack)(char* argv2), std::function<int(const char* argv2)> targets_max)
+{
+
+	// Ensure we clean-up correctly if Control-C (or similar) is signalled.
+  	signal(SIGINT, &cleanup);
+
+	// Options come before the positional arguments.
+	int opt;
+	bool usage = false;
+	while ((opt = getopt(argc, argv, "+w:r:bm:")) != -1)
+	{
+		switch (opt)
+		{
+		    case 'w': oracle_record_path = optarg; break;
+		    case 'r': oracle_replay_path = optarg; break;
+		    case 'b': oracle_binary = true; break;
+		    case 'm': oracle_memory_budget = (size_t) atol(optarg) << 20; break;
+		    default : usage = true;
+		}
+	}
+
+	if (usage || argc - optind < 2)
+	{
+		fprintf(stderr, "usage: %s [-w file] [-r file] [-b] [-m megabytes] target argument [pool size]\n", argv[0]);
+		return 1;
+	}
+	argv[optind - 1] = argv[0];
+	argv += optind - 1;
+	argc -= optind - 1;
+
+	// Size of the pool of attack targets: given as the third argument,
+	// or one target per online processor.
+	int num = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+	num = max(1, min(num, min(targets_max(argv[2]), TARGETS_MAX)));
+
+	// Launch the pool of attack targets, unless replaying a capture.
+	if (oracle_replay_path != NULL)
+		num = 0;
+	for (targets_num = 0; targets_num < num; targets_num++)
+		spawn(targets[targets_num], argv[0], argv[1]);
+
+	// Execute a function representing the attacker.
+	attack(argv[2]);
+
+	// Clean up any resources we've hung on to; the attack has finished
+	// normally, so the status is 0.
+	cleanup(0);
+
+	return 0;
+}
+
+void spawn(target_t &target, char* argv0, char* argv1)
+{
+	// Create pipes to/from attack target; if it fails the reason is stored
+	// in errno, but we'll just abort.
+	// Every end is closed on exec, so a target only keeps its own standard
+	// input and output: neither the other ends of its pipes nor the pipes
+	// of the targets launched before it, which would otherwise never see
+	// the end of their input.
+	if(pipe2(target.target_raw, O_CLOEXEC) == -1)
+		abort();
+
+	if(pipe2(target.attack_raw, O_CLOEXEC) == -1)
+		abort();
+
+	switch(target.pid = fork())
+	{
+	    case -1:
+			// The fork failed; reason is stored in errno, but we'll just abort.
+			abort();
+
+	    case +0:
+	    {
+			// (Re)connect standard input and output to pipes.
+			close(STDOUT_FILENO);
+			if(dup2(target.attack_raw[1], STDOUT_FILENO) == -1)
+				abort();
+
+			close(STDIN_FILENO);
+			if(dup2(target.target_raw[0], STDIN_FILENO) == -1)
+				abort();
+
+			// Produce a sub-process representing the attack target.
+			execl(argv1, argv0, NULL);
+
+			// The target could not be executed; terminate the child.
+			_exit(1);
+	    }
+
+	    default:
+	    {
+			// Close the ends used by the attack target, so that reading from
+			// it fails instead of blocking once it has gone.
+			close(target.target_raw[0]);
+			close(target.attack_raw[1]);
+			target.target_raw[0] = -1;
+			target.attack_raw[1] = -1;
+
+			// Construct handles to attack target standard input and output.
+			if((target.target_out = fdopen(target.attack_raw[0], "r")) == NULL)
+				abort();
+
+			if((target.target_in = fdopen(target.target_raw[1], "w")) == NULL)
+				abort();
+
+			target.reader.attach(target.attack_raw[0]);
+
+			break;
+	    }
+	}
+}
+
+void spawn_replicas(char* path, int num)
+{
+	num = max(1, min(num, TARGETS_MAX));
+	for (; replicas_num < num; replicas_num++)
+		spawn(replicas[replicas_num], path, path);
+}
+
+// closes the pipes of a pool and kills its processes
+static void close_pool(target_t* pool, int num)
+{
+	for (int k = 0; k < num; k++)
+	{
+		target_t &target = pool[k];
+
+		// Close the   buffered communication handles, and with them the
+		// unbuffered ones they wrap; the others are closed by spawn().
+		if( target.target_in != NULL )
+			fclose(target.target_in);
+		else if( target.target_raw[1] != -1 )
+			close(target.target_raw[1]);
+		if( target.target_out != NULL )
+			fclose(target.target_out);
+		else if( target.attack_raw[0] != -1 )
+			close(target.attack_raw[0]);
+
+		// Forcibly terminate the attack target process.
+		if( target.pid > 0 )
+			kill(target.pid, SIGKILL);
+	}
+}
+
+void cleanup(int s)
+{
+	close_pool(targets, targets_num);
+	close_pool(replicas, replicas_num);
+
+	// Forcibly terminate the attacker process; s is 0 when the attack
+	// has finished, the signal otherwise.
+	exit(s == 0 ? 0 : 1);
+}
+
+void target_reader::fill()
+{
+	// move what is left to the front, grow the buffer when it is full
+	if (begin > 0)
+	{
+		memmove(buf, buf + begin, end - begin);
+		end -= begin;
+		begin = 0;
+	}
+	if (cap - end < 4096)
+	{
+		cap = max((size_t) 1 << 18, 2 * cap);
+		char* base = buf == NULL ? NULL : buf - READER_PAD;
+		if ((base = (char*) realloc(base, cap + 2 * READER_PAD)) == NULL)
+			abort();
+		memset(base, 0, READER_PAD);
+		buf = base + READER_PAD;
+	}
+
+	ssize_t num = read(fd, buf + end, cap - end);
+	if (num <= 0)
+	{
+		fprintf(stderr, "oracle: the attack target has stopped answering\n");
+		abort();
+	}
+	end += num;
+
+	// zeros after the data: parsing stops on its own and whole blocks
+	// can be loaded past the end
+	memset(buf + end, 0, READER_PAD);
+}
+
+void target_reader::ensure(size_t num)
+{
+	while (end - begin < num && memchr(buf + begin, '\n', end - begin) == NULL)
+		fill();
+}
+
+// value of a field of 1 to 4 digits ending just before p, without
+// looking at the characters one by one: the field is loaded as a
+// little-endian word, the bytes before it are masked off and the
+// digits are combined pairwise
+static inline int digits4(const char* p, int len)
+{
+	uint32_t w;
+	memcpy(&w, p - 4, 4);
+	uint32_t mask = 0xFFFFFFFFu << (8 * (4 - len));
+	w = (w & mask) - (0x30303030u & mask);
+	w = (w * 10 + (w >> 8)) & 0x00FF00FFu;
+	return (w * 100 + (w >> 16)) & 0xFFFF;
+}
+
+void target_reader::integers(int* v, int num, char sep)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	// fast path for the long runs of short unsigned fields of a trace:
+	// 16 characters at a time, the separators and digits are found with
+	// vector compares, every field between two separators is then
+	// converted by digits4; anything else goes to the scalar loop
+	const __m128i seps  = _mm_set1_epi8(sep);
+	const __m128i below = _mm_set1_epi8('0' - 1);
+	const __m128i above = _mm_set1_epi8('9' + 1);
+	while (i < num && sep != 0)
+	{
+		if (end - begin < 16)
+			ensure(16);
+		if (end - begin < 16 || buf[begin] != sep)
+			break;
+
+		__m128i block = _mm_loadu_si128((const __m128i*) (buf + begin));
+		unsigned is_sep   = _mm_movemask_epi8(_mm_cmpeq_epi8(block, seps));
+		unsigned is_digit = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(block, below),
+		                                                    _mm_cmplt_epi8(block, above)));
+
+		// fields end at a separator: the one starting the block and the
+		// ones after it
+		unsigned rest = is_sep & ~1u;
+		int start = 0, done = 0;
+		while (rest != 0 && i < num)
+		{
+			int stop = __builtin_ctz(rest);
+			int len = stop - start - 1;
+			unsigned field = ((1u << stop) - 1) & ~((2u << start) - 1);
+			if (len < 1 || len > 4 || (is_digit & field) != field)
+				break;
+			v[i++] = digits4(buf + begin + stop, len);
+			start = stop;
+			done = stop;
+			rest &= rest - 1;
+		}
+
+		// not even one field in the block: leave it to the scalar loop
+		if (done == 0)
+			break;
+		begin += done;
+	}
+#endif
+
+	for (; i < num; i++)
+	{
+		// a field is at most a separator, a sign and 10 digits
+		if (end - begin < 16)
+			ensure(16);
+
+		const char* p = buf + begin;
+		if (*p == sep)
+			p++;
+		bool negative = *p == '-';
+		p += negative;
+		int x = 0;
+		while ((unsigned char) (*p - '0') < 10)
+			x = 10 * x + (*p++ - '0');
+		v[i] = negative ? -x : x;
+
+		begin = p - buf;
+	}
+}
+
+int target_reader::integer()
+{
+	while (isspace(peek()))
+		begin++;
+
+	int x;
+	integers(&x, 1, 0);
+	return x;
+}
+
+string target_reader::token()
+{
+	while (isspace(peek()))
+		begin++;
+
+	size_t i = begin;
+	while (true)
+	{
+		for (; i < end; i++)
+			if (isspace(buf[i]))
+			{
+				string s(buf + begin, i - begin);
+				begin = i;
+				return s;
+			}
+
+		// the token goes on past the buffered data
+		i -= begin;
+		fill();
+		i += begin;
+	}
+}
+
+void target_reader::skip_line()
+{
+	while (true)
+	{
+		const char* p = (const char*) memchr(buf + begin, '\n', end - begin);
+		if (p != NULL)
+		{
+			begin = p - buf + 1;
+			return;
+		}
+		begin = end;
+		fill();
+	}
+}
+
+void target_reader::bytes(void* v, size_t num)
+{
+	char* dst = (char*) v;
+	while (num > 0)
+	{
+		if (begin == end)
+			fill();
+		size_t part = min(num, end - begin);
+		memcpy(dst, buf + begin, part);
+		dst += part;
+		begin += part;
+		num -= part;
+	}
+}
+
+void target_reader::skip(size_t num)
+{
+	while (num > 0)
+	{
+		if (begin == end)
+			fill();
+		size_t part = min(num, end - begin);
+		begin += part;
+		num -= part;
+	}
+}
@@ -0,0 +1,296 @@
+#ifndef __ORACLE_H
+#define __ORACLE_H
+
+#include  <cstdio>
+#include  <cstdlib>
+
+#include  <signal.h>
+#include  <unistd.h>
+#include  <string>
+#include  <vector>
+#include  <thread>
+#include  <chrono>
+#include  <functional>
+
+// room kept before and after the data of a target reader, so that
+// fixed-size blocks can be loaded around any field
+#define READER_PAD 64
+
+// buffered reader over the raw output pipe of a target, for the
+// replies too long to go through stdio: large read() calls into a
+// growing buffer, parsing of the fields straight from it (a block at
+// a time where it can) and memchr to skip what is not needed
+// a codec uses either this reader or the stdio stream of a target,
+// never both, since each buffers the pipe on its own
+class target_reader
+{
+public:
+    target_reader() : fd(-1), buf(NULL), cap(0), begin(0), end(0) {}
+    ~target_reader() { if (buf != NULL) free(buf - READER_PAD); }
+
+    void attach(int fd) { this->fd = fd; begin = end = 0; }
+
+    // next character, without consuming it
+    char peek()
+    {
+        if (begin == end)
+            fill();
+        return buf[begin];
+    }
+
+    // num integers, each one preceded by the separator sep
+    void integers(int* v, int num, char sep);
+
+    // a single decimal integer, after any whitespace
+    int integer();
+
+    // the next whitespace-delimited token, leaving the whitespace after it
+    std::string token();
+
+    // consumes everything up to and including the next newline
+    void skip_line();
+
+    // num raw bytes, read or skipped
+    void bytes(void* v, size_t num);
+    void skip(size_t num);
+
+private:
+    int fd;
+    char* buf;
+    size_t cap, begin, end;
+
+    // reads more of the pipe into the buffer, blocking until there is some
+    void fill();
+
+    // makes sure num characters are buffered, or a whole line
+    void ensure(size_t num);
+
+    target_reader(const target_reader&);
+    target_reader &operator=(const target_reader&);
+};
+
+// one copy of the attack target: the pool launches several of them
+// so that independent queries can be answered in parallel
+struct target_t
+{
+    pid_t pid = 0;    // process ID (of either parent or child) from fork
+
+    int target_raw[2] = { -1, -1 };   // unbuffered communication: attacker -> attack target
+    int attack_raw[2] = { -1, -1 };   // unbuffered communication: attack target -> attacker
+
+    FILE* target_out = NULL; // buffered attack target input  stream
+    FILE* target_in  = NULL; // buffered attack target output stream
+
+    target_reader reader;    // fast reader over attack_raw[0], instead of target_out
+};
+
+#define TARGETS_MAX 64
+
+// the pool of attack targets shared by every oracle of the attacker
+extern target_t targets[TARGETS_MAX];
+extern int targets_num;
+
+// the pool of replicas of the attack target, which the attacker runs
+// with keys of its choice (profiling); empty unless spawn_replicas()
+// launches it, killed by cleanup() along with the targets
+extern target_t replicas[TARGETS_MAX];
+extern int replicas_num;
+
+// trace files given on the command line, NULL when not given
+extern const char* oracle_record_path;   // -w file: capture the queries answered by the targets
+extern const char* oracle_replay_path;   // -r file: answer the queries from a capture, offline
+
+// -b: the targets answer in the binary framing of their protocol, for
+// the targets and codecs which have one
+extern bool oracle_binary;
+
+// -m megabytes: memory budget of the traces kept by the attacker, past
+// which they go to a file mapping instead (see trace_matrix); 0, the
+// default, for no budget
+extern size_t oracle_memory_budget;
+
+// the whole of main() for an attacker:
+//   attack [-w file] [-r file] [-b] [-m megabytes] target argument [pool size]
+// launches the pool of attack targets given by argv[1] (its size is
+// the optional argv[3], by default one target per online processor,
+// never more than targets_max), runs attack(argv[2]) and cleans up
+// no target is launched when replaying a capture; exits with status 0
+// once attack() returns
+int oracle_main(int argc, char* argv[], void (*attack)(char* argv2), int targets_max = TARGETS_MAX);
+
+// the same, with the most targets worth launching given by argv[2]: for
+// the attacks whose argument tells how many queries they send at once
+int oracle_main(int argc, char* argv[], void (*attack)(char* argv2), std::function<int(const char* argv2)> targets_max);
+
+// launches one copy of the attack target connected to the attacker
+// through a pair of pipes
+void spawn(target_t &target, char* argv0, char* argv1);
+
+// launches num copies (at least one, at most TARGETS_MAX) of the replica
+// at path into the pool of replicas
+void spawn_replicas(char* path, int num);
+
+// closes the pipes, kills the pools of targets and of replicas and exits,
+// with status 0 when s is 0 (the attack has finished) and 1 otherwise
+// (the signal handler)
+void cleanup(int s);
+
+// typed access to the pool of attack targets
+// the codec describes the protocol of the target:
+//   codec::request, codec::response             the types of a query and of its reply
+//   codec::write(FILE*, const request&)         sends a query to the target
+//   codec::read (target_t&, response&)          reads back the reply, from
+//                                               target_out or the target reader
+// every query is counted; single queries are timed one by one and
+// batches by their throughput; a replay hook may answer queries
+// without the targets and a record hook sees every answered query
+// the queries go to the pool of targets, or to any other pool (the
+// replicas) given to the constructor
+template<typename codec>
+class oracle
+{
+public:
+    typedef typename codec::request  request;
+    typedef typename codec::response response;
+    typedef std::chrono::steady_clock clock;
+
+    // asked first for every query; answers it offline when returning true
+    std::function<bool(const request&, response&)> replay;
+    // called, in query order, for every query answered by a target
+    std::function<void(const request&, const response&)> record;
+
+    // window: number of queries written to a target between two flushes
+    oracle(int window = 64, target_t* pool = targets, int* pool_num = &targets_num) :
+        pool(pool), pool_num(pool_num), window(window), count(0), answered(0), batched(0),
+        latency_sum(0), latency_max(0), batched_time(0) {}
+
+    // a single query, answered by the first target
+    // used for adaptive queries which depend on the previous replies
+    void query(const request &q, response &r)
+    {
+        count++;
+        if (replay && replay(q, r))
+            return;
+        if (*pool_num == 0)
+            missing();
+
+        target_t &target = pool[0];
+        clock::time_point sent = clock::now();
+        codec::write(target.target_in, q);
+        fflush(target.target_in);
+        codec::read(target, r);
+        measure(std::chrono::duration<double>(clock::now() - sent).count());
+
+        if (record)
+            record(q, r);
+    }
+
+    response query(const request &q)
+    {
+        response r;
+        query(q, r);
+        return r;
+    }
+
+    // a batch of independent queries
+    // the queries are dealt round-robin over the targets, which all run
+    // at the same time; the replies land at the position of their query
+    // so the results come back in query order
+    // pipelined: for every target a separate thread keeps writing its
+    // queries (flushing every window of them) while the replies are read
+    // back, so no target waits for a round trip between two queries
+    void query(const std::vector<request> &qs, std::vector<response> &rs)
+    {
+        int num = qs.size();
+        count += num;
+        rs.resize(num);
+
+        // queries left for the targets
+        std::vector<int> live;
+        for (int j = 0; j < num; j++)
+            if (!replay || !replay(qs[j], rs[j]))
+                live.push_back(j);
+        int live_num = live.size();
+        if (live_num == 0)
+            return;
+        int targets_num = *pool_num;
+        if (targets_num == 0)
+            missing();
+
+        clock::time_point start = clock::now();
+
+        // serve the k-th share of the queries with the k-th target
+        auto serve = [&](int k)
+        {
+            target_t &target = pool[k];
+
+            std::thread writer([&]()
+            {
+                int written = 0;
+                for (int i = k; i < live_num; i += targets_num)
+                {
+                    codec::write(target.target_in, qs[live[i]]);
+                    if (++written % window == 0 || i + targets_num >= live_num)
+                        fflush(target.target_in);
+                }
+            });
+
+            for (int i = k; i < live_num; i += targets_num)
+                codec::read(target, rs[live[i]]);
+
+            writer.join();
+        };
+
+        std::vector<std::thread> readers;
+        for (int k = 1; k < targets_num && k < live_num; k++)
+            readers.push_back(std::thread(serve, k));
+        serve(0);
+        for (int k = 0; k < readers.size(); k++)
+            readers[k].join();
+
+        // a pipelined query spends most of its time queued behind the
+        // others, so batches are measured by their throughput instead
+        batched += live_num;
+        batched_time += std::chrono::duration<double>(clock::now() - start).count();
+
+        if (record)
+            for (int i = 0; i < live_num; i++)
+                record(qs[live[i]], rs[live[i]]);
+    }
+
+    // number of queries asked so far, including the replayed ones
+    unsigned int queries() const { return count; }
+
+    // mean and worst latency of the single queries answered by a target, in seconds
+    double latency() const { return answered ? latency_sum / answered : 0; }
+    double latency_peak() const { return latency_max; }
+
+    // queries per second answered by the targets in batches
+    double throughput() const { return batched_time > 0 ? batched / batched_time : 0; }
+
+private:
+    target_t* pool;
+    int* pool_num;
+    int window;
+
+    unsigned int count;
+    unsigned int answered, batched;
+    double latency_sum, latency_max, batched_time;
+
+    void measure(double latency)
+    {
+        answered++;
+        latency_sum += latency;
+        if (latency > latency_max)
+            latency_max = latency;
+    }
+
+    // a query could not be replayed and there is no target to ask
+    void missing()
+    {
+        fprintf(stderr, "oracle: query not found and no attack target to ask\n");
+        abort();
+    }
+};
+
+#endif
@@ -0,0 +1,272 @@
+#include "trace.h"
+
+#include  <cstring>
+#include  <algorithm>
+#include  <fcntl.h>
+#include  <unistd.h>
+#include  <sys/mman.h>
+#include  <sys/stat.h>
+
+using namespace std;
+
+trace_store::trace_store() : shape({ 0, 0, 0 }), record_size(0), count(0), file(NULL), map(NULL), map_size(0)
+{
+}
+
+trace_store::~trace_store()
+{
+    close();
+}
+
+trace_record trace_store::view(unsigned char* base) const
+{
+    trace_record rec;
+    rec.input   = base;
+    rec.output  = rec.input + shape.input_size;
+    rec.value   = (int32_t*) (rec.output + shape.output_size);
+    rec.samples = (int16_t*) (rec.value + 1);
+    rec.samples_num = shape.samples;
+    return rec;
+}
+
+void trace_store::create(const char* path, const trace_layout &layout)
+{
+    close();
+
+    // keep the values and samples of every record aligned
+    shape = layout;
+    shape.input_size  = (shape.input_size  + 3) & ~3;
+    shape.output_size = (shape.output_size + 3) & ~3;
+    record_size = shape.input_size + shape.output_size + sizeof(int32_t) + shape.samples * sizeof(int16_t);
+    record_size = (record_size + 7) & ~7;
+    count = 0;
+
+    if ((file = fopen(path, "wb")) == NULL)
+    {
+        fprintf(stderr, "trace: cannot create %s\n", path);
+        abort();
+    }
+
+    // the count is filled in when the file is closed
+    trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version     = TRACE_VERSION;
+    header.input_size  = shape.input_size;
+    header.output_size = shape.output_size;
+    header.samples     = shape.samples;
+    fwrite(&header, sizeof(header), 1, file);
+
+    scratch.assign(record_size, 0);
+}
+
+trace_record trace_store::record()
+{
+    memset(scratch.data(), 0, record_size);
+    return view(scratch.data());
+}
+
+void trace_store::write()
+{
+    if (fwrite(scratch.data(), record_size, 1, file) != 1)
+    {
+        fprintf(stderr, "trace: write failed\n");
+        abort();
+    }
+    count++;
+}
+
+void trace_store::open(const char* path)
+{
+    close();
+
+    int fd = ::open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < sizeof(trace_header))
+    {
+        fprintf(stderr, "trace: cannot open %s\n", path);
+        abort();
+    }
+
+    map_size = st.st_size;
+    map = (unsigned char*) mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+    {
+        map = NULL;
+        fprintf(stderr, "trace: cannot map %s\n", path);
+        abort();
+    }
+
+    trace_header header;
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) || header.version != TRACE_VERSION)
+    {
+        fprintf(stderr, "trace: %s is not a trace file\n", path);
+        abort();
+    }
+
+    shape.input_size  = header.input_size;
+    shape.output_size = header.output_size;
+    shape.samples     = header.samples;
+    record_size = shape.input_size + shape.output_size + sizeof(int32_t) + shape.samples * sizeof(int16_t);
+    record_size = (record_size + 7) & ~7;
+
+    // a capture cut short (the attacker was killed) still holds all the
+    // records written so far
+    count = (map_size - sizeof(trace_header)) / record_size;
+    if (header.count != 0 && header.count < count)
+        count = header.count;
+
+    index.clear();
+    index.reserve(count);
+    for (size_t i = 0; i < count; i++)
+        index.emplace(string((const char*) at(i).input, shape.input_size), i);
+}
+
+trace_record trace_store::at(size_t i) const
+{
+    return view(map + sizeof(trace_header) + i * record_size);
+}
+
+long trace_store::find(const unsigned char* input) const
+{
+    auto it = index.find(string((const char*) input, shape.input_size));
+    return it == index.end() ? -1 : (long) it->second;
+}
+
+void trace_store::close()
+{
+    if (file != NULL)
+    {
+        // fill in the number of records
+        fseek(file, offsetof(trace_header, count), SEEK_SET);
+        uint64_t num = count;
+        fwrite(&num, sizeof(num), 1, file);
+        fclose(file);
+        file = NULL;
+    }
+
+    if (map != NULL)
+    {
+        munmap(map, map_size);
+        map = NULL;
+        index.clear();
+    }
+}
+
+// bytes of all the trace matrices held in memory, charged against the
+// budget given with -m: a matrix goes to a file mapping when it would
+// take the total past it
+static size_t trace_memory = 0;
+
+trace_matrix::trace_matrix() : rows(0), count(0), stride(0), data(NULL), size(0), file(false)
+{
+}
+
+trace_matrix::~trace_matrix()
+{
+    release();
+}
+
+void trace_matrix::reset(size_t points)
+{
+    release();
+    rows = points;
+    count = 0;
+    stride = 0;
+}
+
+void trace_matrix::release()
+{
+    if (data == NULL)
+        return;
+    if (file)
+        munmap(data, size);
+    else
+    {
+        free(data);
+        trace_memory -= size;
+    }
+    data = NULL;
+    size = 0;
+    file = false;
+}
+
+void trace_matrix::grow(size_t capacity)
+{
+    // rows of whole 64-byte lines
+    capacity = (capacity + 31) & ~(size_t) 31;
+    size_t bytes = max((size_t) 64, rows * capacity * sizeof(int16_t));
+
+    // the budget left once the current block of the matrix is released
+    size_t others = trace_memory - (data != NULL && !file ? size : 0);
+
+    int16_t* block;
+    bool spill = oracle_memory_budget > 0 && others + bytes > oracle_memory_budget;
+    if (!spill)
+    {
+        if (posix_memalign((void**) &block, 64, bytes) != 0)
+            abort();
+    }
+    else
+    {
+        const char* dir = getenv("TMPDIR");
+        string path = string(dir != NULL ? dir : "/tmp") + "/traces.XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if (fd == -1 || unlink(path.c_str()) == -1 || ftruncate(fd, bytes) == -1)
+        {
+            fprintf(stderr, "trace: cannot create a file for the traces in %s\n", path.c_str());
+            abort();
+        }
+        block = (int16_t*) mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (block == MAP_FAILED)
+        {
+            fprintf(stderr, "trace: cannot map a file for the traces\n");
+            abort();
+        }
+    }
+
+    for (size_t i = 0; i < rows; i++)
+        memcpy(block + i * capacity, data + i * stride, count * sizeof(int16_t));
+
+    release();
+    data = block;
+    size = bytes;
+    file = spill;
+    stride = capacity;
+    if (!spill)
+        trace_memory += bytes;
+}
+
+void trace_matrix::append(const int16_t* samples, size_t num)
+{
+    if (count == stride)
+        grow(max((size_t) 32, 2 * stride));
+
+    for (size_t i = 0; i < rows; i++)
+        data[i * stride + count] = num == 0 ? 0 : samples[min(i, num - 1)];
+    count++;
+}
+
+void trace_matrix::extend(size_t num)
+{
+    if (count + num > stride)
+        grow(max(count + num, max((size_t) 32, 2 * stride)));
+    count += num;
+}
+
+void trace_export(unsigned char* rop, size_t size, const mpz_class &op)
+{
+    // most significant byte first, zero-padded to size bytes
+    size_t num = (mpz_sizeinbase(op.get_mpz_t(), 2) + 7) / 8;
+    memset(rop, 0, size);
+    if (op != 0 && num <= size)
+        mpz_export(rop + size - num, NULL, 1, 1, 1, 0, op.get_mpz_t());
+}
+
+void trace_import(mpz_class &rop, const unsigned char* op, size_t size)
+{
+    mpz_import(rop.get_mpz_t(), size, 1, 1, 1, 0, op);
+}
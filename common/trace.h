@@ -0,0 +1,196 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include  <cstdio>
+#include  <cstdlib>
+#include  <cstdint>
+
+#include  <string>
+#include  <vector>
+#include  <unordered_map>
+#include  <gmpxx.h>
+
+#include  "oracle.h"
+
+// capture of the interactions with an attack target
+//
+// a trace file is a header followed by fixed-size records, one per
+// query; a record holds
+//   input  [input_size]    the query sent to the target
+//   output [output_size]   the fixed-size part of the reply (a message or a ciphertext)
+//   value                  the execution time, or the number of samples kept
+//   samples[samples]       the power trace as int16 samples
+// the file is written during acquisition and memory-mapped to replay
+// the queries offline, without any attack target
+
+#define TRACE_MAGIC   "ORACLEv1"
+#define TRACE_VERSION 1
+
+struct trace_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t input_size;    // bytes of input per record
+    uint32_t output_size;   // bytes of output per record
+    uint32_t samples;       // int16 samples per record
+    uint64_t count;         // number of records, set when the file is closed
+};
+
+// sizes of the parts of a record
+struct trace_layout
+{
+    uint32_t input_size, output_size, samples;
+};
+
+// view of a single record
+struct trace_record
+{
+    unsigned char *input, *output;
+    int32_t *value;
+    int16_t *samples;
+    uint32_t samples_num;   // room for samples in the record
+};
+
+class trace_store
+{
+public:
+    trace_store();
+    ~trace_store();
+
+    // starts writing a new trace file with the given layout
+    void create(const char* path, const trace_layout &layout);
+    bool writing() const { return file != NULL; }
+
+    // scratch record to fill in, then appended by write()
+    trace_record record();
+    void write();
+
+    // maps an existing trace file for reading
+    void open(const char* path);
+
+    const trace_layout &layout() const { return shape; }
+    size_t size() const { return count; }
+    trace_record at(size_t i) const;
+
+    // index of the record whose input matches, -1 if it was not captured
+    long find(const unsigned char* input) const;
+
+    void close();
+
+private:
+    trace_layout shape;
+    size_t record_size;
+    size_t count;
+
+    // writing
+    FILE* file;
+    std::vector<unsigned char> scratch;
+
+    // reading
+    unsigned char* map;
+    size_t map_size;
+    std::unordered_map<std::string, size_t> index;
+
+    trace_record view(unsigned char* base) const;
+
+    trace_store(const trace_store&);
+    trace_store &operator=(const trace_store&);
+};
+
+// traces kept by the attacker, as int16 samples
+// point-major: the samples of a point for all the traces are contiguous,
+// the way the statistics over the traces read them, every row 64-byte
+// aligned; traces are appended as columns, the rows growing by doubling
+// the matrix is held in memory as long as all the matrices together
+// stay within the budget given with -m (see oracle_main), past it in a
+// mapping of an unlinked temporary file, so that the page cache rather
+// than the heap holds it; matrices are grown by a single thread
+class trace_matrix
+{
+public:
+    trace_matrix();
+    ~trace_matrix();
+
+    // empties the matrix, for traces of the given number of points
+    void reset(size_t points);
+
+    size_t points() const { return rows; }
+    size_t traces() const { return count; }
+
+    // samples of point i, for traces 0 to traces() - 1
+    int16_t* row(size_t i) { return data + i * stride; }
+    const int16_t* row(size_t i) const { return data + i * stride; }
+
+    // appends a trace; the points past num repeat its last sample
+    void append(const int16_t* samples, size_t num);
+
+    // appends num traces left to be written through row()
+    void extend(size_t num);
+
+    // the matrix lives in a file mapping
+    bool spilled() const { return file; }
+
+private:
+    size_t rows, count, stride;   // stride: room for traces in every row
+    int16_t* data;
+    size_t size;                  // bytes allocated
+    bool file;
+
+    void grow(size_t capacity);
+    void release();
+
+    trace_matrix(const trace_matrix&);
+    trace_matrix &operator=(const trace_matrix&);
+};
+
+// fixed-width big-endian conversion of the numbers sent to and
+// received from the targets
+void trace_export(unsigned char* rop, size_t size, const mpz_class &op);
+void trace_import(mpz_class &rop, const unsigned char* op, size_t size);
+
+// connects an oracle to the trace files given on the command line
+// (see oracle_main), or to the files next to them with the suffix
+// appended to their names: the captures of a second oracle of the same
+// attack (the replicas)
+// the codec describes how its queries are stored:
+//   codec::layout(const response&)                          layout of the records, from the first reply
+//   codec::save  (const request&, unsigned char* input)     input part of a record
+//   codec::save  (const response&, const trace_record&)     output, value and samples of a record
+//   codec::load  (const trace_record&, response&)           reply stored in a record
+template<typename codec>
+void trace_attach(oracle<codec> &o, trace_store &replayed, trace_store &recorded, const char* suffix = "")
+{
+    typedef typename codec::request  request;
+    typedef typename codec::response response;
+
+    if (oracle_replay_path != NULL)
+    {
+        replayed.open((std::string(oracle_replay_path) + suffix).c_str());
+        o.replay = [&replayed](const request &q, response &r)
+        {
+            std::vector<unsigned char> input(replayed.layout().input_size);
+            codec::save(q, input.data());
+            long i = replayed.find(input.data());
+            if (i < 0)
+                return false;
+            codec::load(replayed.at(i), r);
+            return true;
+        };
+    }
+
+    if (oracle_record_path != NULL)
+    {
+        std::string path = std::string(oracle_record_path) + suffix;
+        o.record = [&recorded, path](const request &q, const response &r)
+        {
+            if (!recorded.writing())
+                recorded.create(path.c_str(), codec::layout(r));
+            trace_record rec = recorded.record();
+            codec::save(q, rec.input);
+            codec::save(r, rec);
+            recorded.write();
+        };
+    }
+}
+
+#endif
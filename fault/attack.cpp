@@ -3,14 +3,6 @@
 
 using namespace std;
 
-pid_t pid = 0;    // process ID (of either parent or child) from fork
-
-int target_raw[2];   // unbuffered communication: attacker -> attack target
-int attack_raw[2];   // unbuffered communication: attack target -> attacker
-
-FILE* target_out = NULL; // buffered attack target input  stream
-FILE* target_in  = NULL; // buffered attack target output stream
-
 // AES SubBytes look-up table
 unsigned char SubBytes[256] = 
 {
@@ -186,152 +178,131 @@ unsigned char galois_14[256] =
     0xd7, 0xd9, 0xcb, 0xc5, 0xef, 0xe1, 0xf3, 0xfd, 0xa7, 0xa9, 0xbb, 0xb5, 0x9f, 0x91, 0x83, 0x8d
 };
 
+// protocol of the target *****.D
+// send a fault specification (empty for none) and a message
+// get the respective ciphertext
+struct target_codec
+{
+    struct request  { string fault; mpz_class m; };
+    struct response { mpz_class c; };
+    
+    static void write(FILE* in, const request &q)
+    {
+        gmp_fprintf(in, "%s\n%032ZX\n", q.fault.c_str(), q.m.get_mpz_t());
+    }
+    
+    static void read(target_t &target, response &r)
+    {
+        gmp_fscanf(target.target_out, "%ZX", r.c.get_mpz_t());
+    }
+};
+
+oracle<target_codec> target;
+
+// the fault of a pair when none is given: a random byte in the first
+// byte of the state before the 8th round SubBytes
+#define FAULT_SPEC "8,1,0,0,0"
+
+// most fault pairs taken by the attack
+#define FAULT_PAIRS_MAX 16
+
+// the fault specifications given by the argument of the attack: a
+// number of pairs with the default fault, a list of specifications
+// separated by ';', or a single default pair; at most FAULT_PAIRS_MAX
+vector<string> fault_specs(const char* argv2)
+{
+    vector<string> specs;
+    if (strchr(argv2, ',') != NULL)
+    {
+        string list(argv2);
+        for (size_t start = 0, end; start <= list.size(); start = end + 1)
+        {
+            end = min(list.find(';', start), list.size());
+            if (end > start)
+                specs.push_back(list.substr(start, end - start));
+        }
+    }
+    else
+        specs.assign(max(1, atoi(argv2)), FAULT_SPEC);
+    specs.resize(min((int) specs.size(), FAULT_PAIRS_MAX));
+    return specs;
+}
+
 void attack(char* argv2);
-void cleanup(int s);
 
+// the attack sends the two queries of every pair in one batch,
+// so two attack targets per pair are enough
 int main(int argc, char* argv[])
 {
-
-	// Ensure we clean-up correctly if Control-C (or similar) is signalled.
-  	signal(SIGINT, &cleanup);
-
-	// Create pipes to/from attack target; if it fails the reason is stored
-	// in errno, but we'll just abort.
-	if(pipe(target_raw) == -1)
-		abort();
-	  
-	if(pipe(attack_raw) == -1)
-		abort();
-
-	switch(pid = fork()) 
-	{ 
-	    case -1: 
-			// The fork failed; reason is stored in errno, but we'll just abort.
-			abort();
-
-	    case +0: 
-	    {
-			// (Re)connect standard input and output to pipes.
-			close(STDOUT_FILENO);
-			if(dup2(attack_raw[1], STDOUT_FILENO) == -1)
-				abort();
-
-			close(STDIN_FILENO);
-			if(dup2(target_raw[0], STDIN_FILENO) == -1)
-				abort();
-
-			// Produce a sub-process representing the attack target.
-			execl(argv[1], argv[0], NULL);
-
-			// Break and clean-up once finished.
-			break;
-	    }
-
-	    default:
-	    {
-			// Construct handles to attack target standard input and output.
-			if((target_out = fdopen(attack_raw[0], "r")) == NULL) 
-				abort();
-
-			if((target_in = fdopen(target_raw[1], "w")) == NULL)
-				abort();
-
-			// Execute a function representing the attacker.
-			attack(argv[2]);
-
-			// Break and clean-up once finished.
-			break;
-	    }
-	}
-
-	// Clean up any resources we've hung on to.
-	cleanup(SIGINT);
-
-	return 0;
+	return oracle_main(argc, argv, &attack, [](const char* argv2) { return 2 * (int) fault_specs(argv2).size(); });
 }
 
-// interacts with the target *****.D
-// send a message
-// get the respective ciphertext
-void interact(string fault, mpz_class &m, mpz_class &c, unsigned int &interaction_number)
+// interacts with the pool of targets *****.D
+// send a batch of fault specifications and messages
+// get the respective ciphertexts in query order
+void interact(const vector<string> &faults, const vector<mpz_class> &ms, vector<mpz_class> &cs)
 {
-    // interact with 61061.D
-	gmp_fprintf(target_in, "%s\n%032ZX\n", fault.c_str(), m.get_mpz_t());
-	fflush(target_in);
+    vector<target_codec::request> qs(ms.size());
+    for (int j = 0; j < ms.size(); j++)
+        qs[j] = { faults[j], ms[j] };
     
-    // get ciphertext
-    gmp_fscanf(target_out, "%ZX", c.get_mpz_t());
+    vector<target_codec::response> rs;
+    target.query(qs, rs);
     
-    interaction_number++;
-}
-
-// gets the i-th byte of a byte string
-unsigned char get_byte(mpz_class &byte_string, int i)
-{
-    // (15 - i)*8  -> Big Endian
-    //        i*8  -> Little Endian
-    unsigned char byte = (unsigned char) ((mpz_class(byte_string >> (15-i)*8)).get_ui());
-    return byte & 0xFF;
+    cs.resize(ms.size());
+    for (int j = 0; j < ms.size(); j++)
+        cs[j] = rs[j].c;
 }
 
-unsigned char ComputeFPrime(unsigned char* c, unsigned char* c_prime, vector<unsigned char> &r, vector<unsigned char> &k)
+// converts a block to its 16 bytes, most significant first (I2OSP),
+// zero-padded on the left
+void get_bytes(const mpz_class &block, unsigned char* bytes)
 {
-    unsigned char A = SubBytesInverse[
-                        galois_9[SubBytesInverse[c[12]^k[12]] ^ r[12]] ^
-                       galois_14[SubBytesInverse[c[9] ^k[9] ] ^ r[13]] ^
-                       galois_11[SubBytesInverse[c[6] ^k[6] ] ^ r[14]] ^
-                       galois_13[SubBytesInverse[c[3] ^k[3] ] ^ r[15]] ];
-    unsigned char B = SubBytesInverse[
-                        galois_9[SubBytesInverse[c_prime[12]^k[12]] ^ r[12]] ^
-                       galois_14[SubBytesInverse[c_prime[9] ^k[9] ] ^ r[13]] ^
-                       galois_11[SubBytesInverse[c_prime[6] ^k[6] ] ^ r[14]] ^
-                       galois_13[SubBytesInverse[c_prime[3] ^k[3] ] ^ r[15]] ];
-    return (A ^ B);
+    size_t num = (mpz_sizeinbase(block.get_mpz_t(), 2) + 7) / 8;
+    memset(bytes, 0, 16);
+    if (block != 0 && num <= 16)
+        mpz_export(bytes + 16 - num, NULL, 1, 1, 0, 0, block.get_mpz_t());
 }
 
-unsigned char ComputeFPrime2(unsigned char* c, unsigned char* c_prime, vector<unsigned char> &r, vector<unsigned char> &k)
+// the correct and the faulty ciphertext of the same message, as bytes
+struct fault_pair
 {
-    unsigned char A = SubBytesInverse[
-                        galois_9[SubBytesInverse[c[7] ^k[7] ] ^ r[3]] ^
-                       galois_14[SubBytesInverse[c[0] ^k[0] ] ^ r[0]] ^
-                       galois_11[SubBytesInverse[c[13]^k[13]] ^ r[1]] ^
-                       galois_13[SubBytesInverse[c[10]^k[10]] ^ r[2]] ];
-    unsigned char B = SubBytesInverse[
-                        galois_9[SubBytesInverse[c_prime[7] ^k[7] ] ^ r[3]] ^
-                       galois_14[SubBytesInverse[c_prime[0] ^k[0] ] ^ r[0]] ^
-                       galois_11[SubBytesInverse[c_prime[13]^k[13]] ^ r[1]] ^
-                       galois_13[SubBytesInverse[c_prime[10]^k[10]] ^ r[2]] ];
-    return (A ^ B);
-}
+    unsigned char c[16], c_prime[16];
+};
 
-unsigned char ComputeFPrime1(unsigned char* c, unsigned char* c_prime, vector<unsigned char> &r, vector<unsigned char> &k)
+// the key bytes of a byte position of a fault pair, grouped by the
+// difference delta = SubBytesInverse[c ^ k] ^ SubBytesInverse[c' ^ k]
+// each of them gives: the bucket of delta holds keys[first[delta]] to
+// keys[first[delta + 1] - 1]
+// built once per pair, with a counting sort, so that a system of
+// equations is solved by looking up the buckets of its deltas instead
+// of trying the 256 values of every key byte
+struct delta_table
 {
-    unsigned char A = SubBytesInverse[
-                        galois_9[SubBytesInverse[c[5] ^k[5] ] ^  r[9]] ^
-                       galois_14[SubBytesInverse[c[2] ^k[2] ] ^ r[10]] ^
-                       galois_11[SubBytesInverse[c[15]^k[15]] ^ r[11]] ^
-                       galois_13[SubBytesInverse[c[8] ^k[8] ] ^  r[8]] ];
-    unsigned char B = SubBytesInverse[
-                        galois_9[SubBytesInverse[c_prime[5] ^k[5] ] ^  r[9]] ^
-                       galois_14[SubBytesInverse[c_prime[2] ^k[2] ] ^ r[10]] ^
-                       galois_11[SubBytesInverse[c_prime[15]^k[15]] ^ r[11]] ^
-                       galois_13[SubBytesInverse[c_prime[8] ^k[8] ] ^  r[8]] ];
-    return (A ^ B);
-}
+    unsigned short first[257];
+    unsigned char keys[256];
+    unsigned char delta[256];   // the difference given by every key byte
+};
 
-unsigned char ComputeFPrime3(unsigned char* c, unsigned char* c_prime, vector<unsigned char> &r, vector<unsigned char> &k)
+void delta_tables(const fault_pair &p, delta_table* tables)
 {
-    unsigned char A = SubBytesInverse[
-                        galois_9[SubBytesInverse[c[14]^k[14]] ^ r[6]] ^
-                       galois_14[SubBytesInverse[c[11]^k[11]] ^ r[7]] ^
-                       galois_11[SubBytesInverse[c[4] ^k[4] ] ^ r[4]] ^
-                       galois_13[SubBytesInverse[c[1] ^k[1] ] ^ r[5]] ];    
-    unsigned char B = SubBytesInverse[
-                        galois_9[SubBytesInverse[c_prime[14]^k[14]] ^ r[6]] ^
-                       galois_14[SubBytesInverse[c_prime[11]^k[11]] ^ r[7]] ^
-                       galois_11[SubBytesInverse[c_prime[4] ^k[4] ] ^ r[4]] ^
-                       galois_13[SubBytesInverse[c_prime[1] ^k[1] ] ^ r[5]] ];
-    return (A ^ B);
+    for (int i = 0; i < 16; i++)
+    {
+        delta_table &t = tables[i];
+        unsigned short count[256] = { 0 };
+        for (int k = 0; k < 256; k++)
+        {
+            t.delta[k] = SubBytesInverse[p.c[i] ^ k] ^ SubBytesInverse[p.c_prime[i] ^ k];
+            count[t.delta[k]]++;
+        }
+        t.first[0] = 0;
+        for (int d = 0; d < 256; d++)
+            t.first[d + 1] = t.first[d] + count[d];
+        unsigned short next[256];
+        memcpy(next, t.first, sizeof(next));
+        for (int k = 0; k < 256; k++)
+            t.keys[next[t.delta[k]]++] = k;
+    }
 }
 
 // AES Key Inverse
@@ -360,223 +331,312 @@ void KeyInv(unsigned char* r, const unsigned char* k, int round)
     r[0]  = SubBytes[r[13]] ^ k[0] ^ round_char;    
 }
 
+// a hypothesis for the 4 key bytes of a system of equations, packed in
+// the order of the byte positions of the system
+struct quartet
+{
+    unsigned char b[4];
+};
+
+// the byte positions of the 4 systems of equations of the first step:
+// 1st, 3rd, 8th and 10th key byte, then 13th, 4th, 15th and 6th, 0th,
+// 11th, 2nd and 9th, and 7th, 14th, 5th and 12th
+const int systems[4][4] =
+{
+    { 10, 13,  0,  7 },
+    {  1,  4, 11, 14 },
+    {  8, 15,  2,  5 },
+    {  3,  6,  9, 12 }
+};
+
+// 256-bit set of the values of a key byte
+struct byte_set
+{
+    uint64_t w[4];
+};
+
 // first step of the fault attack
-// solves one system of equations
-void equations(mpz_class &c, mpz_class &c_prime, 
-                vector<unsigned char> &k, 
-                vector< vector <unsigned char> > &k_1, 
-                vector< vector <unsigned char> > &k_2, 
-                vector< vector <unsigned char> > &k_3, 
-                int i_0, int i_1, int i_2, int i_3)
+// solves one system of equations: every hypothesis for the byte pos[0]
+// gives delta, and the hypotheses for the bytes pos[1], pos[2] and
+// pos[3] are the buckets of delta, 2 delta and 3 delta of their tables;
+// every combination of them is a hypothesis for the system
+// with several fault pairs (the tables of the j-th pair are tables[16 j]
+// to tables[16 j + 15]) every pair gives its own delta, and a hypothesis
+// must satisfy the system for all of them: since the three bytes are
+// constrained independently once pos[0] is fixed, the intersection of
+// the combinations is the combination of the intersections, which are
+// taken byte by byte over the bitsets of the buckets
+void equations(const delta_table* tables, int pairs, const int* pos, vector<quartet> &hypotheses)
 {
     for (int i = 0; i < 256; i++)
     {
-        // a hypothesis for the current key byte
-        unsigned char k_i_0 = i;
-        
-        // compute initial value of delta, then check if the remaining 3 equations hold
-        // computed for 1st, 3rd, 8th and 10th key byte
-        unsigned char delta = (SubBytesInverse[get_byte(c, i_0)^k_i_0] ^ SubBytesInverse[get_byte(c_prime, i_0)^k_i_0]);
-        
-        vector <unsigned char> k_i_1_vect, k_i_2_vect, k_i_3_vect;
-        
-        // computed for 13th, 4th, 15th and 6th key byte
-        for (int j = 0; j < 256; j++)
+        byte_set sets[3];
+        memset(sets, 0xFF, sizeof(sets));
+        for (int j = 0; j < pairs; j++)
         {
-            unsigned char k_i_1 = j;
-            if ( delta == (SubBytesInverse[get_byte(c, i_1)^k_i_1] ^ SubBytesInverse[get_byte(c_prime, i_1)^k_i_1]) )
-                k_i_1_vect.push_back(k_i_1);
+            const delta_table* t = tables + 16 * j;
+            unsigned char delta = t[pos[0]].delta[i];
+            unsigned char d[3] = { delta, galois_2[delta], galois_3[delta] };
+            for (int b = 0; b < 3; b++)
+            {
+                const delta_table &t_b = t[pos[b + 1]];
+                byte_set bucket = { { 0, 0, 0, 0 } };
+                for (int a = t_b.first[d[b]]; a < t_b.first[d[b] + 1]; a++)
+                    bucket.w[t_b.keys[a] >> 6] |= (uint64_t) 1 << (t_b.keys[a] & 63);
+                for (int w = 0; w < 4; w++)
+                    sets[b].w[w] &= bucket.w[w];
+            }
         }
         
-        if (k_i_1_vect.empty())
-            continue;
+        // the values left for each byte, in increasing order
+        unsigned char values[3][256];
+        int num[3] = { 0, 0, 0 };
+        for (int b = 0; b < 3; b++)
+            for (int w = 0; w < 4; w++)
+                for (uint64_t x = sets[b].w[w]; x != 0; x &= x - 1)
+                    values[b][num[b]++] = 64 * w + __builtin_ctzll(x);
         
-        // computed for 0th, 11th, 2nd and 9th key byte
-        for (int j = 0; j < 256; j++)
-        {
-            unsigned char k_i_2 = j;
-            if ( galois_2[delta] == (SubBytesInverse[get_byte(c, i_2)^k_i_2] ^ SubBytesInverse[get_byte(c_prime, i_2)^k_i_2]) )
-                k_i_2_vect.push_back(k_i_2);
-        }
+        for (int a = 0; a < num[0]; a++)
+            for (int b = 0; b < num[1]; b++)
+                for (int c = 0; c < num[2]; c++)
+                    hypotheses.push_back({ { (unsigned char) i, values[0][a], values[1][b], values[2][c] } });
+    }
+}
+
+// number of flattened hypotheses taken at a time by a thread of the
+// second step
+#define DFA_CHUNK 64
+
+// second step of the fault attack
+// the 10th round key k and the 9th round key r = KeyInv(k) satisfy four
+// equations on the fault f of the state before the 9th round MixColumns,
+// one per column, which give f, f, 3 f and 2 f:
+//   E0 = SubBytesInverse[ 9 X(12, r12) ^ 14 X(9,  r13) ^ 11 X(6,  r14) ^ 13 X(3, r15) ] ^ (the same for c')
+//   E1 = SubBytesInverse[ 9 X(5,  r9 ) ^ 14 X(2,  r10) ^ 11 X(15, r11) ^ 13 X(8, r8 ) ] ^ ...
+//   E3 = SubBytesInverse[ 9 X(14, r6 ) ^ 14 X(11, r7 ) ^ 11 X(4,  r4 ) ^ 13 X(1, r5 ) ] ^ ...
+//   E2 = SubBytesInverse[ 9 X(7,  r3 ) ^ 14 X(0,  r0 ) ^ 11 X(13, r1 ) ^ 13 X(10, r2) ] ^ ...
+// with X(a, r_b) = SubBytesInverse[c[a] ^ k[a]] ^ r[b]
+// the bytes of every equation come from all four systems, so none of
+// them is complete before the last system is fixed; instead the
+// hypotheses are taken a system at a time and every term is computed at
+// the first level where all its bytes are known: the innermost level,
+// over the packed hypotheses of the last system, only adds the two terms
+// of E1 and of E3 which depend on it and checks E3 == 3 E1 before going
+// on with E2 and E0
+// nothing is allocated past the tables of SubBytesInverse[c ^ k]
+// scheduling: the hypotheses of the first three systems are flattened
+// into a single index, handed out DFA_CHUNK at a time from a shared
+// counter, so that every thread gets work until the very end whatever
+// the sizes of the lists; the first thread to verify the key raises a
+// flag which the others check between two indices, and all of them
+// leave the parallel region normally
+// true with the AES key which encrypts m into c
+bool second_step(const fault_pair &p, const vector<quartet>* hypotheses, const unsigned char* m, unsigned char* key)
+{
+    // SubBytesInverse[c ^ k] for both ciphertexts (s = 0 for c, 1 for c'),
+    // every byte position and every key byte
+    unsigned char sc[2][16][256];
+    for (int s = 0; s < 2; s++)
+        for (int a = 0; a < 16; a++)
+            for (int k = 0; k < 256; k++)
+                sc[s][a][k] = SubBytesInverse[(s == 0 ? p.c : p.c_prime)[a] ^ k];
+    
+    const vector<quartet> &h_0 = hypotheses[0], &h_1 = hypotheses[1], &h_2 = hypotheses[2], &h_3 = hypotheses[3];
+    long n_1 = h_1.size(), n_2 = h_2.size();
+    long total = h_0.size() * n_1 * n_2;
+    
+    std::atomic<long> next(0);
+    std::atomic<bool> found(false);
+    
+    #pragma omp parallel
+    {
+        unsigned char k[16];
         
-        if (k_i_2_vect.empty())
-            continue;
+        // the terms of E3 and E2 known with the first two systems, for
+        // the hypotheses i_01 = i_0 * n_1 + i_1 of these systems
+        unsigned char e_3[2], e_2[2];
+        long last = -1;
         
-        // computed for 7th, 14th, 5th and 12th key byte
-        for (int j = 0; j < 256; j++)
+        // verification step: the candidates which satisfy the equations
+        // are queued and verified AES_BATCH at a time
+        unsigned char candidates[AES_BATCH][16];
+        int queued = 0;
+        auto verify = [&]()
         {
-            unsigned char k_i_3 = j;
-            if ( galois_3[delta] == (SubBytesInverse[get_byte(c, i_3)^k_i_3] ^ SubBytesInverse[get_byte(c_prime, i_3)^k_i_3]) )
-                k_i_3_vect.push_back(k_i_3);
-        }
+            int i = aes_verify(candidates, queued, m, p.c);
+            queued = 0;
+            bool expected = false;
+            if (i >= 0 && found.compare_exchange_strong(expected, true))
+                memcpy(key, candidates[i], 16);
+            return i >= 0;
+        };
         
-        if (k_i_3_vect.empty())
-            continue;
+        long start;
+        while (!found.load(std::memory_order_relaxed) && (start = next.fetch_add(DFA_CHUNK)) < total)
+            for (long w = start; w < std::min(total, start + DFA_CHUNK) && !found.load(std::memory_order_relaxed); w++)
+            {
+                long i_01 = w / n_2;
+                if (i_01 != last)
+                {
+                    const quartet &q_0 = h_0[i_01 / n_1], &q_1 = h_1[i_01 % n_1];
+                    k[10] = q_0.b[0]; k[13] = q_0.b[1]; k[0] = q_0.b[2]; k[7] = q_0.b[3];
+                    k[1] = q_1.b[0]; k[4] = q_1.b[1]; k[11] = q_1.b[2]; k[14] = q_1.b[3];
+                    for (int s = 0; s < 2; s++)
+                    {
+                        e_3[s] = galois_11[sc[s][4][k[4]] ^ k[4] ^ k[0]];
+                        e_2[s] = galois_11[sc[s][13][k[13]] ^ SubBytes[k[14] ^ k[10]] ^ k[1]];
+                    }
+                    last = i_01;
+                }
+                
+                const quartet &q_2 = h_2[w % n_2];
+                k[8] = q_2.b[0]; k[15] = q_2.b[1]; k[2] = q_2.b[2]; k[5] = q_2.b[3];
+                
+                // the terms of E3, E2 and E1 known with the first three
+                // systems, and the parts of the terms of E1 and E3 left
+                // which do not depend on the last system
+                unsigned char a_3[2], a_2[2], a_1[2], x_1[2], y_1[2], x_3[2], y_3[2];
+                for (int s = 0; s < 2; s++)
+                {
+                    a_3[s] = e_3[s] ^ galois_13[sc[s][1][k[1]] ^ k[5] ^ k[1]];
+                    a_2[s] = e_2[s] ^ galois_13[sc[s][10][k[10]] ^ SubBytes[k[15] ^ k[11]] ^ k[2]];
+                    a_1[s] = galois_11[sc[s][15][k[15]] ^ k[11] ^ k[7]] ^ galois_13[sc[s][8][k[8]] ^ k[8] ^ k[4]];
+                    x_1[s] = sc[s][5][k[5]] ^ k[5];      // 9 X(5, r9) = 9 (x_1 ^ k9)
+                    y_1[s] = sc[s][2][k[2]] ^ k[10];     // 14 X(2, r10) = 14 (y_1 ^ k6)
+                    x_3[s] = sc[s][14][k[14]] ^ k[2];    // 9 X(14, r6) = 9 (x_3 ^ k6)
+                    y_3[s] = sc[s][11][k[11]] ^ k[7];    // 14 X(11, r7) = 14 (y_3 ^ k3)
+                }
+                
+                for (const quartet &q_3 : h_3)
+                {
+                    unsigned char k_3 = q_3.b[0], k_6 = q_3.b[1], k_9 = q_3.b[2], k_12 = q_3.b[3];
+                    
+                    unsigned char f = SubBytesInverse[a_1[0] ^ galois_9[x_1[0] ^ k_9] ^ galois_14[y_1[0] ^ k_6]] ^
+                                      SubBytesInverse[a_1[1] ^ galois_9[x_1[1] ^ k_9] ^ galois_14[y_1[1] ^ k_6]];
+                    unsigned char f_3 = SubBytesInverse[a_3[0] ^ galois_9[x_3[0] ^ k_6] ^ galois_14[y_3[0] ^ k_3]] ^
+                                        SubBytesInverse[a_3[1] ^ galois_9[x_3[1] ^ k_6] ^ galois_14[y_3[1] ^ k_3]];
+                    if (f_3 != galois_3[f])
+                        continue;
+                    
+                    k[3] = k_3; k[6] = k_6; k[9] = k_9; k[12] = k_12;
+                    
+                    unsigned char e[2];
+                    for (int s = 0; s < 2; s++)
+                        e[s] = SubBytesInverse[a_2[s] ^ galois_9[sc[s][7][k[7]] ^ SubBytes[k[12] ^ k[8]] ^ k[3]] ^
+                                               galois_14[sc[s][0][k[0]] ^ SubBytes[k[13] ^ k[9]] ^ k[0] ^ rcon[10]]];
+                    if ((e[0] ^ e[1]) != galois_2[f])
+                        continue;
+                    
+                    for (int s = 0; s < 2; s++)
+                        e[s] = SubBytesInverse[galois_9 [sc[s][12][k[12]] ^ k[12] ^ k[8]] ^
+                                               galois_14[sc[s][9][k[9]] ^ k[13] ^ k[9]] ^
+                                               galois_11[sc[s][6][k[6]] ^ k[14] ^ k[10]] ^
+                                               galois_13[sc[s][3][k[3]] ^ k[15] ^ k[11]]];
+                    if ((e[0] ^ e[1]) != f)
+                        continue;
+                    cout << '.' << flush;
+                    
+                    // get the AES key from the 10th round key
+                    memcpy(candidates[queued], k, 16);
+                    for (int j = 10; j > 0; j--)
+                        KeyInv(candidates[queued], candidates[queued], j);
+                    
+                    if (++queued == AES_BATCH && verify())
+                        break;
+                }
+            }
         
-        // if the system of equations holds, save the key hypotheses
-        k.push_back(k_i_0);
-        k_1.push_back(k_i_1_vect);
-        k_2.push_back(k_i_2_vect);
-        k_3.push_back(k_i_3_vect);
+        // the candidates left over by the last hypotheses of the thread
+        if (queued > 0)
+            verify();
     }
+    
+    return found;
 }
 
 
 void attack(char* argv2)
 {
-    // count the number of interactions with the target
-    unsigned int interaction_number = 0;
-    
-    // declare variables for communication with the target
-    mpz_class m, c, c_prime;
-    // produce a random message
-    gmp_randclass randomness(gmp_randinit_default);
-    // compute a random message
-    m = randomness.get_z_bits(128);
-    
-    // encrypt message without fault;
-    interact("", m, c, interaction_number);
-    // encrypt message with fault
-    interact("8,1,0,0,0", m, c_prime, interaction_number);
+    vector<string> specs = fault_specs(argv2);
+    int pairs = specs.size();
     
-    cout << "c       = " << hex << c << "\n";
-    cout << "c_prime = " << hex << c_prime << "\n";
-    
-    // vectors of hypotheses for 1st, 3rd, 8th and 10th key byte
-    vector <unsigned char> k_10, k_1, k_8, k_3;
-    
-    // vectors of hypotheses for key 0th, 7th and 13th key byte
-    // for each hypothesis for key byte 10
-    vector< vector <unsigned char> > k_13,  k_0,  k_7;
-    
-    // vectors of hypotheses for key 4th, 11th and 14th key byte
-    // for each hypothesis for key byte 1
-    vector< vector <unsigned char> >  k_4, k_11, k_14;
-    
-    // vectors of hypotheses for key 2nd, 4th and 15th key byte
-    // for each hypothesis for key byte 8
-    vector< vector <unsigned char> > k_15,  k_2,  k_5;
+    // a specification is round, function, before or after, row and column;
+    // the systems of equations of the first step assume a fault around
+    // the 8th round SubBytes which ShiftRows then moves to the first
+    // column of the state, so that the row and the column must be the
+    // same, and those of the second step a fault in the first row: the
+    // second step takes the first pair with such a fault
+    int second = -1;
+    for (int j = 0; j < pairs; j++)
+    {
+        int f[5];
+        if (sscanf(specs[j].c_str(), "%d,%d,%d,%d,%d", &f[0], &f[1], &f[2], &f[3], &f[4]) != 5 ||
+            f[0] != 8 || f[1] != 1 || f[3] != f[4])
+        {
+            fprintf(stderr, "attack: the fault %s does not reach the first column of the 8th round MixColumns\n", specs[j].c_str());
+            abort();
+        }
+        if (f[3] == 0 && second == -1)
+            second = j;
+    }
+    if (second == -1)
+    {
+        fprintf(stderr, "attack: no fault in the first row for the second step\n");
+        abort();
+    }
     
-    // vectors of hypotheses for key 6th, 9th and 12th key byte
-    // for each hypothesis for key byte 3
-    vector< vector <unsigned char> >  k_6,  k_9, k_12;
+    // produce random messages, one per pair
+    gmp_randclass randomness(gmp_randinit_default);
+    vector<mpz_class> messages(pairs);
+    for (int j = 0; j < pairs; j++)
+        messages[j] = randomness.get_z_bits(128);
     
-    // compute the first step system of equations for every case outlined above
-    equations(c, c_prime, k_10, k_13,  k_0,  k_7, 10, 13,  0,  7);
-    equations(c, c_prime,  k_1,  k_4, k_11, k_14,  1,  4, 11, 14);
-    equations(c, c_prime,  k_8, k_15,  k_2,  k_5,  8, 15,  2,  5);
-    equations(c, c_prime,  k_3,  k_6,  k_9, k_12,  3,  6,  9, 12);
+    // encrypt every message without fault and with its fault, in one batch
+    vector<string> faults;
+    vector<mpz_class> ms, cs;
+    for (int j = 0; j < pairs; j++)
+    {
+        faults.push_back("");
+        faults.push_back(specs[j]);
+        ms.push_back(messages[j]);
+        ms.push_back(messages[j]);
+    }
+    interact(faults, ms, cs);
     
-    vector< vector <unsigned char> > k_hypotheses;
+    // the pairs as bytes, and their tables of differences
+    vector<fault_pair> pair(pairs);
+    vector<delta_table> tables(16 * pairs);
+    for (int j = 0; j < pairs; j++)
+    {
+        cout << "c       = " << hex << cs[2 * j] << "\n";
+        cout << "c_prime = " << hex << cs[2 * j + 1] << "\n";
+        
+        get_bytes(cs[2 * j], pair[j].c);
+        get_bytes(cs[2 * j + 1], pair[j].c_prime);
+        delta_tables(pair[j], &tables[16 * j]);
+    }
     
-    //holder for the byte array
-    unsigned char m_char[16] = {0}, c_char[16] = {0}, c_prime_char[16] = {0};
+    // solve the systems of equations of the first step, for all the pairs
+    vector<quartet> hypotheses[4];
+    for (int s = 0; s < 4; s++)
+        equations(&tables[0], pairs, systems[s], hypotheses[s]);
+    cout << "Hypotheses: " << dec << hypotheses[0].size() << " x " << hypotheses[1].size() << " x "
+         << hypotheses[2].size() << " x " << hypotheses[3].size() << "\n";
     
-    // convert m, c and c_prime from mpz_class to a byte array
-    // have the behaviour of I2OSP
-    mpz_export(m_char, NULL, 1, 1, 0, 0, m.get_mpz_t());
-    mpz_export(c_char, NULL, 1, 1, 0, 0, c.get_mpz_t());
-    mpz_export(c_prime_char, NULL, 1, 1, 0, 0, c_prime.get_mpz_t());
+    // the message as bytes
+    unsigned char m_char[16];
+    get_bytes(messages[second], m_char);
     
-    #pragma omp parallel for
-    for (int i_10 = 0 ; i_10 < k_10.size(); i_10++ )   // each hypothesis for 10th key byte
+    unsigned char key[16];
+    if (!second_step(pair[second], hypotheses, m_char, key))
     {
-        vector<unsigned char> key(16);
-        for (unsigned char byte_13 : k_13[i_10])       // each respective hypothesis for 13th key byte
-            for (unsigned char byte_0 : k_0[i_10])     // each respective hypothesis for  0th key byte
-                for (unsigned char byte_7 : k_7[i_10]) // each respective hypothesis for  7th key byte
-                    
-                    for (int i_1 = 0 ; i_1 < k_1.size(); i_1++ )       // each hypothesis for 1st key byte
-                        for (unsigned char byte_4 : k_4[i_1])          // each respective hypothesis for  4th key byte
-                            for (unsigned char byte_11 : k_11[i_1])    // each respective hypothesis for 11th key byte
-                                for (unsigned char byte_14 : k_14[i_1])// each respective hypothesis for 14th key byte
-                                    
-                                    for (int i_8 = 0; i_8 < k_8.size(); i_8++ )      // each hypothesis for 8th key byte
-                                        for (unsigned char byte_15 : k_15[i_8])      // each respective hypothesis for 15th key byte
-                                            for (unsigned char byte_2 : k_2[i_8])    // each respective hypothesis for  2nd key byte
-                                                for (unsigned char byte_5 : k_5[i_8])// each respective hypothesis for  5th key byte
-                                                    
-                                                    for (int i_3 = 0; i_3 < k_3.size(); i_3++ )        // each hypothesis for 3rd key byte
-                                                        for (unsigned char byte_6 : k_6[i_3])          // each respective hypothesis for  6th key byte
-                                                            for (unsigned char byte_9 : k_9[i_3])      // each respective hypothesis for  9th key byte
-                                                                for (unsigned char byte_12 : k_12[i_3])// each respective hypothesis for 12th key byte
-                                                                {
-                                                                    // 'assemble' the hypothetical key
-                                                                    key[0] = byte_0;
-                                                                    key[1] = k_1[i_1];
-                                                                    key[2] = byte_2;
-                                                                    key[3] = k_3[i_3];
-                                                                    key[4] = byte_4;
-                                                                    key[5] = byte_5;
-                                                                    key[6] = byte_6;
-                                                                    key[7] = byte_7;
-                                                                    key[8] = k_8[i_8];
-                                                                    key[9] = byte_9;
-                                                                    key[10] = k_10[i_10];
-                                                                    key[11] = byte_11;
-                                                                    key[12] = byte_12;
-                                                                    key[13] = byte_13;
-                                                                    key[14] = byte_14;
-                                                                    key[15] = byte_15;
-                                                                    
-                                                                    vector<unsigned char> inv_key(16);
-                                                                    
-                                                                    // inverse the hypothetical key: to get 9th round key
-                                                                    KeyInv(inv_key.data(), key.data(), 10);
-                                                                    
-                                                                    // second step of the attack
-                                                                    unsigned char f_prime = ComputeFPrime(c_char, c_prime_char, inv_key, key);
-                                                                    if (f_prime != ComputeFPrime1(c_char, c_prime_char, inv_key, key))
-                                                                        continue;
-                                                                    if (galois_3[f_prime] != ComputeFPrime3(c_char, c_prime_char, inv_key, key))
-                                                                        continue;
-                                                                    if (galois_2[f_prime] != ComputeFPrime2(c_char, c_prime_char, inv_key, key))
-                                                                        continue;
-                                                                    cout << '.' << flush;
-                                                                    
-                                                                    // get the AES key from the 10th round key
-                                                                    for (int j = 10; j > 0; j--)
-                                                                        KeyInv(key.data(), key.data(), j);
-                                                                    
-                                                                    // verification step
-                                                                    unsigned char t[16];
-        
-                                                                    AES_KEY rk;
-                                                                    AES_set_encrypt_key(key.data(), 128, &rk);
-                                                                    AES_encrypt(m_char, t, &rk);  
-
-                                                                    if(!memcmp(t, c_char, 16))
-                                                                    {
-                                                                        printf("\nAES.Enc( k, m ) == c\nk = ");
-                                                                        for (int i = 0; i < 16; i++)
-                                                                            printf("%02X", key[i]);
-                                                                        
-                                                                        cout << "\nNumber of interactions with the target: " << interaction_number << "\n\n";
-                                                                        exit(0);
-                                                                    }   
-                                                                }
+        cout << "Attack has failed\n";
+        return;
     }
     
-    cout << "Attack has failed\n";
-}
-
-
-void cleanup(int s) 
-{
-	// Close the   buffered communication handles.
-	fclose(target_in);
-	fclose(target_out);
-
-	// Close the unbuffered communication handles.
-	close(target_raw[0]); 
-	close(target_raw[1]); 
-	close(attack_raw[0]); 
-	close(attack_raw[1]); 
-
-	// Forcibly terminate the attack target process.
-	if( pid > 0 )
-		kill(pid, SIGKILL);
-
-	// Forcibly terminate the attacker process.
-	exit(1); 
+    printf("\nAES.Enc( k, m ) == c\nk = ");
+    for (int i = 0; i < 16; i++)
+        printf("%02X", key[i]);
+    
+    cout << "\nNumber of interactions with the target: " << target.queries() << "\n\n";
 }
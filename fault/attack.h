@@ -5,13 +5,19 @@
 #include  <cstdlib>
 
 #include  <cstring>
+#include  <cstdint>
 #include  <signal.h>
 #include  <unistd.h>
 #include  <fcntl.h>
 #include  <gmpxx.h>
 #include  <fstream>
 #include  <algorithm>
-#include  <openssl/aes.h>
+#include  <vector>
+#include  <thread>
+#include  <atomic>
 #include  <X11/Xlib.h>
 
+#include  "oracle.h"
+#include  "aes.h"
+
 #endif
\ No newline at end of file
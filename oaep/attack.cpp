@@ -3,76 +3,34 @@
 
 using namespace std;
 
-pid_t pid = 0;    // process ID (of either parent or child) from fork
-
-int target_raw[2];   // unbuffered communication: attacker -> attack target
-int attack_raw[2];   // unbuffered communication: attack target -> attacker
+// protocol of the target *****.D
+// send a label and a ciphertext
+// get an error code
+struct target_codec
+{
+    struct request  { mpz_class l, c; };
+    struct response { int code; };
+    
+    static void write(FILE* in, const request &q)
+    {
+        gmp_fprintf(in, "%ZX\n%0256ZX\n", q.l.get_mpz_t(), q.c.get_mpz_t());
+    }
+    
+    static void read(target_t &target, response &r)
+    {
+        fscanf(target.target_out, "%X", &r.code);
+    }
+};
 
-FILE* target_out = NULL; // buffered attack target input  stream
-FILE* target_in  = NULL; // buffered attack target output stream
+oracle<target_codec> target;
 
 void attack(char* argv2);
-void cleanup(int s);
 
+// every query depends on the reply to the previous one,
+// so a single attack target is enough
 int main(int argc, char* argv[])
 {
-
-	// Ensure we clean-up correctly if Control-C (or similar) is signalled.
-  	signal(SIGINT, &cleanup);
-
-	// Create pipes to/from attack target; if it fails the reason is stored
-	// in errno, but we'll just abort.
-	if(pipe(target_raw) == -1)
-		abort();
-	  
-	if(pipe(attack_raw) == -1)
-		abort();
-
-	switch(pid = fork()) 
-	{ 
-	    case -1: 
-			// The fork failed; reason is stored in errno, but we'll just abort.
-			abort();
-
-	    case +0: 
-	    {
-			// (Re)connect standard input and output to pipes.
-			close(STDOUT_FILENO);
-			if(dup2(attack_raw[1], STDOUT_FILENO) == -1)
-				abort();
-
-			close(STDIN_FILENO);
-			if(dup2(target_raw[0], STDIN_FILENO) == -1)
-				abort();
-
-			// Produce a sub-process representing the attack target.
-			execl(argv[1], argv[0], NULL);
-
-			// Break and clean-up once finished.
-			break;
-	    }
-
-	    default:
-	    {
-			// Construct handles to attack target standard input and output.
-			if((target_out = fdopen(attack_raw[0], "r")) == NULL) 
-				abort();
-
-			if((target_in = fdopen(target_raw[1], "w")) == NULL)
-				abort();
-
-			// Execute a function representing the attacker.
-			attack(argv[2]);
-
-			// Break and clean-up once finished.
-			break;
-	    }
-	}
-
-	// Clean up any resources we've hung on to.
-	cleanup(SIGINT);
-
-	return 0;
+	return oracle_main(argc, argv, &attack, 1);
 }
 
 // interact with the target by inputting a label and a ciphertext
@@ -80,27 +38,18 @@ int main(int argc, char* argv[])
 int interact(const mpz_class &l_prime, const mpz_class &c_prime)
 {
     // interact with 61061.D
-	gmp_fprintf(target_in, "%ZX\n%0256ZX\n", l_prime.get_mpz_t(), c_prime.get_mpz_t());
-	fflush(target_in);
-
     //       code 0: decryption success 
     // error code 1: y >= B
     // error code 2: y < B
     
     // return error code
-	int code;
-	fscanf(target_out, "%X", &code);
-    
-    return code;
+    return target.query({ l_prime, c_prime }).code;
 }
 
 // attack the target to recover the message
 // unmask and unpad the result from the attack to obtain the "pure" message
 void attack(char* argv2)
 {
-    // count the number of interactions with the target
-    unsigned int interaction_number = 0;
-    
 	// interact with 61061.conf
     // reading the input
 	ifstream config (argv2, ifstream::in);
@@ -140,7 +89,6 @@ void attack(char* argv2)
         mpz_powm(f_1_exp.get_mpz_t(), f_1.get_mpz_t(), e.get_mpz_t(), N.get_mpz_t()); // compute (f_1)^e (mod N)
         c_1 = f_1_exp * c_prime % N; // c_1 = (f_1)^e * c' (mod N)
         code = interact(l_prime, c_1); // send c_1 to the oracle and get the error code
-        interaction_number++; // increment number of interactions
         i++; // increment exponent for updating f_1 at the next round
     }
     
@@ -158,7 +106,6 @@ void attack(char* argv2)
         mpz_powm(f_2_exp.get_mpz_t(), f_2.get_mpz_t(), e.get_mpz_t(), N.get_mpz_t()); // compute (f_2)^e (mod N)
         c_2 = f_2_exp * c_prime % N; // c_2 = (f_2)^e * c' (mod N)      
         code = interact(l_prime, c_2); // send c_2 to the oracle and get error code
-        interaction_number++; // increment number of interactions
         
         // break out of the loop and proceed to step 3.
         // must occur at or before f_2 = ceil(2N/B) * f_1/2
@@ -190,7 +137,6 @@ void attack(char* argv2)
         c_3 = f_3_exp * c_prime % N; // c_3 = (f_3)^e * c' (mod N)
         
         code = interact(l_prime, c_3); // send c_3 to the oracle and get error code
-        interaction_number++; // increment number of interactions
         
         if (code == 1)
             m_min = (i_bound * N + B + f_3 - 1) / f_3; // m_min = ceil((i*N + B)/f_3)
@@ -326,27 +272,8 @@ void attack(char* argv2)
         printf("%02X", (unsigned int)message[i]);
     cout << "\n\n";
     
-    cout << "Number of interactions with the target: " << interaction_number << "\n\n";
+    cout << "Number of interactions with the target: " << target.queries() << "\n";
+    cout << "Mean query latency: " << target.latency() * 1e6 << " us\n\n";
 
 }
 
-
-void cleanup(int s) 
-{
-	// Close the   buffered communication handles.
-	fclose(target_in);
-	fclose(target_out);
-
-	// Close the unbuffered communication handles.
-	close(target_raw[0]); 
-	close(target_raw[1]); 
-	close(attack_raw[0]); 
-	close(attack_raw[1]); 
-
-	// Forcibly terminate the attack target process.
-	if( pid > 0 )
-		kill(pid, SIGKILL);
-
-	// Forcibly terminate the attacker process.
-	exit(1); 
-}
@@ -14,4 +14,6 @@
 #include  <openssl/evp.h>
 #include  <openssl/rsa.h>
 
+#include  "oracle.h"
+
 #endif
\ No newline at end of file
@@ -3,14 +3,6 @@
 
 using namespace std;
 
-pid_t pid = 0;    // process ID (of either parent or child) from fork
-
-int target_raw[2];   // unbuffered communication: attacker -> attack target
-int attack_raw[2];   // unbuffered communication: attack target -> attacker
-
-FILE* target_out = NULL; // buffered attack target input  stream
-FILE* target_in  = NULL; // buffered attack target output stream
-
 // AES SubBytes look-up table
 unsigned char SubBytes[256] = 
 {
@@ -53,275 +45,1988 @@ int HammingWeight[256] =
     4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8
 };
 
+// AES inverse SubBytes look-up table, filled in from SubBytes
+unsigned char InvSubBytes[256];
+
+// an AES block (message, ciphertext or key) as bytes, in AES byte order
+struct aes_block { unsigned char b[16]; };
+
+// samples of a trace kept by the codec, from the first one: all of them
+// when 0, otherwise up to the last point of interest
+int power_span = 0;
+
+// first byte of a binary power trace reply, checked to stay in step
+#define POWER_FRAME '\x01'
+
+struct trace_aligner;
+
+// where the codec writes the traces of a batch as it reads them, instead
+// of keeping them in the replies: a column of the matrix of traces per
+// reply, with the samples at the points of interest of the trace shifted
+// by its lag (when aligned), so that a batch is never held in full
+struct trace_sink
+{
+    trace_matrix* traces;
+    const vector<int>* points;
+    const trace_aligner* aligner;   // NULL when the traces are not aligned
+    
+    // writes the num samples of a trace into column j, returns its lag
+    int keep(const int16_t* samples, int num, size_t j) const;
+};
+
+// protocol of the target *****.D
+// send a message
+// get the power consumption while encrypting it and the ciphertext
+struct target_codec
+{
+    struct request  { aes_block m; };
+    // with a sink (set by the caller before the query) the samples go to
+    // column j of its matrix and power stays empty, unless a capture is
+    // recorded, which takes them from power
+    struct response
+    {
+        vector<int16_t> power;
+        aes_block c;
+        
+        const trace_sink* sink = NULL;
+        size_t j = 0;
+        int lag = 0;
+    };
+    
+    static void write(FILE* in, const request &q)
+    {
+        static const char hex[] = "0123456789ABCDEF";
+        char line[33];
+        for (int j = 0; j < 16; j++)
+        {
+            line[2*j]     = hex[q.m.b[j] >> 4];
+            line[2*j + 1] = hex[q.m.b[j] & 15];
+        }
+        line[32] = '\n';
+        fwrite(line, 1, 33, in);
+    }
+    
+    // the reply is a line "length,sample,sample,..." then a line with the
+    // ciphertext; it is parsed straight from the read() buffer of the
+    // target, stopping after the power_span samples needed and skipping
+    // the rest of the line with memchr
+    // with -b the target answers with a binary frame instead: POWER_FRAME,
+    // the length (uint32), the samples (int16) and the 16 bytes of the
+    // ciphertext, in native byte order
+    static void read(target_t &target, response &r)
+    {
+        target_reader &in = target.reader;
+        
+        if (oracle_binary)
+        {
+            unsigned char frame;
+            in.bytes(&frame, 1);
+            if (frame != POWER_FRAME)
+            {
+                fprintf(stderr, "power: expected a binary power trace\n");
+                abort();
+            }
+            
+            uint32_t length;
+            in.bytes(&length, sizeof(length));
+            
+            int num = power_span > 0 ? std::min(length, (uint32_t) power_span) : length;
+            int16_t* power = samples(r, num);
+            in.bytes(power, num * sizeof(int16_t));
+            in.skip((length - num) * sizeof(int16_t));
+            kept(r, power, num);
+            
+            in.bytes(r.c.b, 16);
+            return;
+        }
+        
+        int length = in.integer();
+        
+        // ignore the rest of the input after the span; the samples are
+        // stored as int16, saturated
+        int num = power_span > 0 ? std::min(length, power_span) : length;
+        static thread_local vector<int> values;
+        values.resize(num);
+        in.integers(values.data(), num, ',');
+        in.skip_line();
+        int16_t* power = samples(r, num);
+        for (int i = 0; i < num; i++)
+            power[i] = max(-32768, min(values[i], 32767));
+        kept(r, power, num);
+        
+        string c = in.token();
+        if (c.size() != 32)
+        {
+            fprintf(stderr, "power: expected a ciphertext\n");
+            abort();
+        }
+        for (int j = 0; j < 16; j++)
+            r.c.b[j] = stoi(c.substr(2*j, 2), NULL, 16);
+        in.skip_line();
+    }
+    
+    // trace records: the message, the ciphertext, the number of samples
+    // and the samples of the power trace
+    // the capacity is set by the first trace, a trace of the pilot set
+    // acquired in full
+    static trace_layout layout(const response &r)
+    {
+        return { 16, 16, (uint32_t) r.power.size() };
+    }
+    
+    static void save(const request &q, unsigned char* input)
+    {
+        memcpy(input, q.m.b, 16);
+    }
+    
+    static void save(const response &r, const trace_record &rec)
+    {
+        memcpy(rec.output, r.c.b, 16);
+        int num = min((uint32_t) r.power.size(), rec.samples_num);
+        memcpy(rec.samples, r.power.data(), num * sizeof(int16_t));
+        *rec.value = num;
+    }
+    
+    static void load(const trace_record &rec, response &r)
+    {
+        memcpy(r.c.b, rec.output, 16);
+        if (r.sink != NULL)
+            r.lag = r.sink->keep(rec.samples, *rec.value, r.j);
+        else
+            r.power.assign(rec.samples, rec.samples + *rec.value);
+    }
+    
+    // room for the num samples of a reply: its power, or a buffer of the
+    // reading thread when they only go to the sink
+    static int16_t* samples(response &r, int num)
+    {
+        static thread_local vector<int16_t> buffer;
+        vector<int16_t> &power = r.sink == NULL || oracle_record_path != NULL ? r.power : buffer;
+        power.resize(num);
+        return power.data();
+    }
+    
+    static void kept(response &r, const int16_t* power, int num)
+    {
+        if (r.sink != NULL)
+            r.lag = r.sink->keep(power, num, r.j);
+    }
+};
+
+// protocol of the target replica *****.R
+// send a message and a key
+// get the power consumption while encrypting the message with the key
+// and the ciphertext, the way the target answers
+struct replica_codec
+{
+    struct request  { aes_block m, k; };
+    typedef target_codec::response response;
+    
+    static void write(FILE* in, const request &q)
+    {
+        target_codec::write(in, { q.m });
+        target_codec::write(in, { q.k });
+    }
+    
+    static void read(target_t &target, response &r)
+    {
+        target_codec::read(target, r);
+    }
+    
+    // trace records: the message and the key, then the reply as the
+    // target stores it
+    static trace_layout layout(const response &r)
+    {
+        trace_layout l = target_codec::layout(r);
+        l.input_size = 32;
+        return l;
+    }
+    
+    static void save(const request &q, unsigned char* input)
+    {
+        memcpy(input, q.m.b, 16);
+        memcpy(input + 16, q.k.b, 16);
+    }
+    
+    static void save(const response &r, const trace_record &rec)
+    {
+        target_codec::save(r, rec);
+    }
+    
+    static void load(const trace_record &rec, response &r)
+    {
+        target_codec::load(rec, r);
+    }
+};
+
+oracle<target_codec>  target(16);
+oracle<replica_codec> replica(16, replicas, &replicas_num);
+
+// capture replayed and capture recorded (-r and -w), and the same for
+// the replica, in the files of the same names followed by REPLICA_SUFFIX
+#define REPLICA_SUFFIX ".replica"
+trace_store replayed, recorded;
+trace_store replica_replayed, replica_recorded;
+
 void attack(char* argv2);
-void cleanup(int s);
 
 int main(int argc, char* argv[])
 {
+	return oracle_main(argc, argv, &attack);
+}
 
-	// Ensure we clean-up correctly if Control-C (or similar) is signalled.
-  	signal(SIGINT, &cleanup);
+// interacts with the pool of targets *****.D
+// send a batch of messages
+// get the respective ciphertexts and power consumptions in query order
+void interact(const vector<aes_block> &ms, vector< vector<int16_t> > &powers, vector<aes_block> &cs)
+{
+    vector<target_codec::request> qs(ms.size());
+    for (int j = 0; j < ms.size(); j++)
+        qs[j].m = ms[j];
+    
+    vector<target_codec::response> rs;
+    target.query(qs, rs);
+    
+    powers.resize(ms.size());
+    cs.resize(ms.size());
+    for (int j = 0; j < ms.size(); j++)
+    {
+        powers[j].swap(rs[j].power);
+        cs[j] = rs[j].c;
+    }
+}
 
-	// Create pipes to/from attack target; if it fails the reason is stored
-	// in errno, but we'll just abort.
-	if(pipe(target_raw) == -1)
-		abort();
-	  
-	if(pipe(attack_raw) == -1)
-		abort();
+// the same, the traces going straight to the sink: the trace of the j-th
+// message to column first + j of its matrix, which must have room for
+// them; lags[j] is its lag
+void interact(const vector<aes_block> &ms, const trace_sink &sink, size_t first, vector<aes_block> &cs, vector<int> &lags)
+{
+    vector<target_codec::request> qs(ms.size());
+    vector<target_codec::response> rs(ms.size());
+    for (int j = 0; j < ms.size(); j++)
+    {
+        qs[j].m = ms[j];
+        rs[j].sink = &sink;
+        rs[j].j = first + j;
+    }
+    
+    target.query(qs, rs);
+    
+    cs.resize(ms.size());
+    lags.resize(ms.size());
+    for (int j = 0; j < ms.size(); j++)
+    {
+        cs[j] = rs[j].c;
+        lags[j] = rs[j].lag;
+    }
+}
 
-	switch(pid = fork()) 
-	{ 
-	    case -1: 
-			// The fork failed; reason is stored in errno, but we'll just abort.
-			abort();
+// interacts with the pool of replicas *****.R
+// send a batch of messages and the keys to encrypt them with
+// get the respective ciphertexts and power consumptions in query order
+void profile(const vector<aes_block> &ms, const vector<aes_block> &ks, vector< vector<int16_t> > &powers, vector<aes_block> &cs)
+{
+    vector<replica_codec::request> qs(ms.size());
+    for (int j = 0; j < ms.size(); j++)
+        qs[j] = { ms[j], ks[j] };
+    
+    vector<replica_codec::response> rs;
+    replica.query(qs, rs);
+    
+    powers.resize(ms.size());
+    cs.resize(ms.size());
+    for (int j = 0; j < ms.size(); j++)
+    {
+        powers[j].swap(rs[j].power);
+        cs[j] = rs[j].c;
+    }
+}
 
-	    case +0: 
-	    {
-			// (Re)connect standard input and output to pipes.
-			close(STDOUT_FILENO);
-			if(dup2(attack_raw[1], STDOUT_FILENO) == -1)
-				abort();
+// blocked single-precision matrix product C = A·B for the correlations,
+// all matrices row-major with their leading dimension
+// m has to be a multiple of GEMM_MR and n of GEMM_NR: the callers pad
+// the rows of B and C with zeros
+// the columns of B are taken GEMM_NC at a time, so that the block of B
+// stays in the L2 cache while every row of A goes past it, and each
+// GEMM_MR x GEMM_NR tile of C is accumulated in registers over the
+// whole of k
+#define GEMM_MR 4
+#define GEMM_NR 32
+#define GEMM_NC 256
 
-			close(STDIN_FILENO);
-			if(dup2(target_raw[0], STDIN_FILENO) == -1)
-				abort();
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx512f")))
+static void gemm_avx512(int m, int n, int k, const float* a, int lda, const float* b, int ldb, float* c, int ldc)
+{
+    for (int jc = 0; jc < n; jc += GEMM_NC)
+        for (int i = 0; i < m; i += GEMM_MR)
+            for (int j = jc; j < std::min(n, jc + GEMM_NC); j += GEMM_NR)
+            {
+                __m512 c00 = _mm512_setzero_ps(), c01 = _mm512_setzero_ps();
+                __m512 c10 = _mm512_setzero_ps(), c11 = _mm512_setzero_ps();
+                __m512 c20 = _mm512_setzero_ps(), c21 = _mm512_setzero_ps();
+                __m512 c30 = _mm512_setzero_ps(), c31 = _mm512_setzero_ps();
+                const float* ai = a + i * (size_t) lda;
+                for (int p = 0; p < k; p++)
+                {
+                    const float* bp = b + p * (size_t) ldb + j;
+                    __m512 b0 = _mm512_loadu_ps(bp), b1 = _mm512_loadu_ps(bp + 16);
+                    __m512 a0 = _mm512_set1_ps(ai[p]);
+                    __m512 a1 = _mm512_set1_ps(ai[p + lda]);
+                    __m512 a2 = _mm512_set1_ps(ai[p + 2*lda]);
+                    __m512 a3 = _mm512_set1_ps(ai[p + 3*lda]);
+                    c00 = _mm512_fmadd_ps(a0, b0, c00); c01 = _mm512_fmadd_ps(a0, b1, c01);
+                    c10 = _mm512_fmadd_ps(a1, b0, c10); c11 = _mm512_fmadd_ps(a1, b1, c11);
+                    c20 = _mm512_fmadd_ps(a2, b0, c20); c21 = _mm512_fmadd_ps(a2, b1, c21);
+                    c30 = _mm512_fmadd_ps(a3, b0, c30); c31 = _mm512_fmadd_ps(a3, b1, c31);
+                }
+                float* ci = c + i * (size_t) ldc + j;
+                _mm512_storeu_ps(ci,           c00); _mm512_storeu_ps(ci + 16,           c01);
+                _mm512_storeu_ps(ci + ldc,     c10); _mm512_storeu_ps(ci + ldc + 16,     c11);
+                _mm512_storeu_ps(ci + 2*ldc,   c20); _mm512_storeu_ps(ci + 2*ldc + 16,   c21);
+                _mm512_storeu_ps(ci + 3*ldc,   c30); _mm512_storeu_ps(ci + 3*ldc + 16,   c31);
+            }
+}
 
-			// Produce a sub-process representing the attack target.
-			execl(argv[1], argv[0], NULL);
+__attribute__((target("avx2,fma")))
+static void gemm_avx2(int m, int n, int k, const float* a, int lda, const float* b, int ldb, float* c, int ldc)
+{
+    for (int jc = 0; jc < n; jc += GEMM_NC)
+        for (int i = 0; i < m; i += GEMM_MR)
+            for (int j = jc; j < std::min(n, jc + GEMM_NC); j += GEMM_NR)
+            {
+                // 4 rows of 32 columns: 16 accumulators of 8 floats
+                __m256 acc[GEMM_MR][4];
+                for (int r = 0; r < GEMM_MR; r++)
+                    for (int q = 0; q < 4; q++)
+                        acc[r][q] = _mm256_setzero_ps();
+                const float* ai = a + i * (size_t) lda;
+                for (int p = 0; p < k; p++)
+                {
+                    const float* bp = b + p * (size_t) ldb + j;
+                    __m256 b0 = _mm256_loadu_ps(bp),      b1 = _mm256_loadu_ps(bp + 8);
+                    __m256 b2 = _mm256_loadu_ps(bp + 16), b3 = _mm256_loadu_ps(bp + 24);
+                    for (int r = 0; r < GEMM_MR; r++)
+                    {
+                        __m256 ar = _mm256_broadcast_ss(ai + r * (size_t) lda + p);
+                        acc[r][0] = _mm256_fmadd_ps(ar, b0, acc[r][0]);
+                        acc[r][1] = _mm256_fmadd_ps(ar, b1, acc[r][1]);
+                        acc[r][2] = _mm256_fmadd_ps(ar, b2, acc[r][2]);
+                        acc[r][3] = _mm256_fmadd_ps(ar, b3, acc[r][3]);
+                    }
+                }
+                for (int r = 0; r < GEMM_MR; r++)
+                    for (int q = 0; q < 4; q++)
+                        _mm256_storeu_ps(c + (i + r) * (size_t) ldc + j + 8*q, acc[r][q]);
+            }
+}
+#endif
 
-			// Break and clean-up once finished.
-			break;
-	    }
+static void gemm_plain(int m, int n, int k, const float* a, int lda, const float* b, int ldb, float* c, int ldc)
+{
+    for (int jc = 0; jc < n; jc += GEMM_NC)
+        for (int i = 0; i < m; i++)
+        {
+            int nc = std::min(n - jc, GEMM_NC);
+            float* ci = c + i * (size_t) ldc + jc;
+            std::fill(ci, ci + nc, 0.0f);
+            for (int p = 0; p < k; p++)
+            {
+                float ap = a[i * (size_t) lda + p];
+                const float* bp = b + p * (size_t) ldb + jc;
+                for (int j = 0; j < nc; j++)
+                    ci[j] += ap * bp[j];
+            }
+        }
+}
 
-	    default:
-	    {
-			// Construct handles to attack target standard input and output.
-			if((target_out = fdopen(attack_raw[0], "r")) == NULL) 
-				abort();
+// picks the widest kernel the processor runs
+static void gemm(int m, int n, int k, const float* a, int lda, const float* b, int ldb, float* c, int ldc)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static const int isa = __builtin_cpu_supports("avx512f") ? 2 :
+                           __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? 1 : 0;
+    if (isa == 2)
+        return gemm_avx512(m, n, k, a, lda, b, ldb, c, ldc);
+    if (isa == 1)
+        return gemm_avx2(m, n, k, a, lda, b, ldb, c, ldc);
+#endif
+    gemm_plain(m, n, k, a, lda, b, ldb, c, ldc);
+}
 
-			if((target_in = fdopen(target_raw[1], "w")) == NULL)
-				abort();
+// matrix of the simulated powers hyp[guess*256 + value] = table[value ^ guess]
+// of every guess of a key byte and every value of the message byte
+// row k is the table with its entries permuted by XOR with k: the high
+// nibble of k picks which 16-entry block of the table lands in each
+// block of the row, the low nibble is the same shuffle (pshufb) inside
+// every block
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+static void hypotheses_ssse3(const unsigned char* table, int8_t* hyp)
+{
+    __m128i blocks[16];
+    for (int b = 0; b < 16; b++)
+        blocks[b] = _mm_loadu_si128((const __m128i*) (table + 16*b));
+    const __m128i lanes = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    
+    for (int k = 0; k < 256; k++)
+    {
+        __m128i shuffle = _mm_xor_si128(lanes, _mm_set1_epi8(k & 15));
+        for (int b = 0; b < 16; b++)
+            _mm_storeu_si128((__m128i*) (hyp + 256*k + 16*b),
+                             _mm_shuffle_epi8(blocks[b ^ (k >> 4)], shuffle));
+    }
+}
+#endif
 
-			// Execute a function representing the attacker.
-			attack(argv[2]);
+static void hypotheses(const unsigned char* table, int8_t* hyp)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("ssse3"))
+        return hypotheses_ssse3(table, hyp);
+#endif
+    for (int k = 0; k < 256; k++)
+        for (int v = 0; v < 256; v++)
+            hyp[256*k + v] = table[v ^ k];
+}
 
-			// Break and clean-up once finished.
-			break;
-	    }
-	}
+// leakage models: the simulated power for the guess k of a key byte and
+// the value d of the data byte it is combined with
+//   model::source       the data: a byte of the message or of the ciphertext
+//   model::last_round   the guesses are bytes of the last round key
+//   model::xor_form     the power only depends on d ^ k
+//   model::leak(d, k)   the simulated power, within int8
+// a model only builds its matrix of hypotheses; the correlation is the
+// same code for every model
+enum leak_source { LEAK_MESSAGE, LEAK_CIPHERTEXT, LEAK_SOURCES };
 
-	// Clean up any resources we've hung on to.
-	cleanup(SIGINT);
+// Hamming Weight of the first SubBytes output: XOR -> SBox -> Hamming Weight
+struct hw_sbox
+{
+    static const leak_source source = LEAK_MESSAGE;
+    static const bool last_round = false, xor_form = true;
+    static int leak(int d, int k) { return HammingWeight[SubBytes[d ^ k]]; }
+};
 
-	return 0;
+// Hamming Distance between the input and the output of the first SubBytes
+struct hd_sbox
+{
+    static const leak_source source = LEAK_MESSAGE;
+    static const bool last_round = false, xor_form = true;
+    static int leak(int d, int k) { return HammingWeight[(d ^ k) ^ SubBytes[d ^ k]]; }
+};
+
+// Hamming Distance between the byte of the state which the last round
+// turns into the ciphertext byte n, InvSubBytes[c[n] ^ k], and c[n]
+// itself: the leakage of a register which loads the state byte through
+// ShiftRows and ends up holding the ciphertext byte, as in a byte-wise
+// last round with ShiftRows folded into its addressing
+// not the register of an implementation working on the state in place,
+// where InvSubBytes[c[n] ^ k] is overwritten by the ciphertext byte at
+// the position it was shifted from: that distance depends on two bytes
+// of the ciphertext, and the accumulator sums the traces by the value
+// of a single one
+struct hd_last_byte
+{
+    static const leak_source source = LEAK_CIPHERTEXT;
+    static const bool last_round = true, xor_form = false;
+    static int leak(int d, int k) { return HammingWeight[InvSubBytes[d ^ k] ^ d]; }
+};
+
+// value of the first SubBytes output, shifted into int8 (a constant
+// does not change a correlation)
+struct identity_sbox
+{
+    static const leak_source source = LEAK_MESSAGE;
+    static const bool last_round = false, xor_form = true;
+    static int leak(int d, int k) { return SubBytes[d ^ k] - 128; }
+};
+
+// a single bit of the first SubBytes output
+template<int b>
+struct bit_sbox
+{
+    static const leak_source source = LEAK_MESSAGE;
+    static const bool last_round = false, xor_form = true;
+    static int leak(int d, int k) { return (SubBytes[d ^ k] >> b) & 1; }
+};
+
+// matrix of the hypotheses of a model, built on first use (before the
+// parallel regions)
+template<typename model>
+const int8_t* hypotheses()
+{
+    static int8_t hyp[256 * 256] __attribute__((aligned(64)));
+    static bool built = false;
+    if (built)
+        return hyp;
+    
+    if (model::xor_form)
+    {
+        unsigned char table[256];
+        for (int x = 0; x < 256; x++)
+            table[x] = model::leak(x, 0);
+        hypotheses(table, hyp);
+    }
+    else
+        for (int k = 0; k < 256; k++)
+            for (int d = 0; d < 256; d++)
+                hyp[256*k + d] = model::leak(d, k);
+    built = true;
+    return hyp;
 }
 
-// interacts with the target *****.D
-// send a message
-// get the respective ciphertext and the power consumption
-vector<int> interact(mpz_class &m, mpz_class &c, unsigned int &interaction_number)
+// a model picked at run time
+struct leakage_model
+{
+    const char* name;
+    leak_source source;
+    bool last_round;
+    const int8_t* hyp;
+};
+
+template<typename model>
+leakage_model leakage(const char* name)
+{
+    return { name, model::source, model::last_round, hypotheses<model>() };
+}
+
+// the models known by name: hw, hd, lastbyte, id and bit0 to bit7
+bool leakage_named(const string &name, leakage_model &m)
 {
-    // interact with 61061.D
-	gmp_fprintf(target_in, "%032ZX\n", m.get_mpz_t());
-	fflush(target_in);
+    if      (name == "hw"      ) m = leakage<hw_sbox>("hw");
+    else if (name == "hd"      ) m = leakage<hd_sbox>("hd");
+    else if (name == "lastbyte") m = leakage<hd_last_byte>("lastbyte");
+    else if (name == "id"      ) m = leakage<identity_sbox>("id");
+    else if (name == "bit0"    ) m = leakage< bit_sbox<0> >("bit0");
+    else if (name == "bit1"    ) m = leakage< bit_sbox<1> >("bit1");
+    else if (name == "bit2"    ) m = leakage< bit_sbox<2> >("bit2");
+    else if (name == "bit3"    ) m = leakage< bit_sbox<3> >("bit3");
+    else if (name == "bit4"    ) m = leakage< bit_sbox<4> >("bit4");
+    else if (name == "bit5"    ) m = leakage< bit_sbox<5> >("bit5");
+    else if (name == "bit6"    ) m = leakage< bit_sbox<6> >("bit6");
+    else if (name == "bit7"    ) m = leakage< bit_sbox<7> >("bit7");
+    else
+        return false;
+    return true;
+}
+
+// undoes the AES-128 key schedule: the cipher key from the last round key
+void aes_first_round_key(const unsigned char* last, unsigned char* key)
+{
+    static const unsigned char rcon[10] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36 };
     
-    // get power consumption and ciphertext
-	int length;
-	gmp_fscanf(target_out, "%d", &length);
+    memcpy(key, last, 16);
+    for (int r = 9; r >= 0; r--)
+    {
+        for (int i = 15; i >= 4; i--)
+            key[i] ^= key[i - 4];
+        key[0] ^= SubBytes[key[13]] ^ rcon[r];
+        key[1] ^= SubBytes[key[14]];
+        key[2] ^= SubBytes[key[15]];
+        key[3] ^= SubBytes[key[12]];
+    }
+}
+
+// tiles of the correlation step, in points and guesses
+#define CPA_TILE    256
+#define CPA_GUESSES 64
+
+// online CPA statistics of the traces acquired so far, without keeping
+// the traces themselves
+// the hypothesis for a key byte only depends on the value of the data
+// byte it is mixed with, so the samples are summed per value of every
+// byte of the data (message, ciphertext) the models use: Σx, Σx² and
+// Σxy of every guess of any model at every point follow from these sums
+// and from the number of traces with each value, while Σy and Σy² are
+// kept per point; folding a trace in costs 16 additions per point and
+// data, however many traces came before it
+struct cpa_accumulator
+{
+    int points;                     // points correlated
+    int stride;                     // room for points per value
+    long count;                     // traces folded in
+    vector<long>    counts[LEAK_SOURCES];   // [byte][value]        traces with that value of the byte
+    vector<int32_t> sums  [LEAK_SOURCES];   // [byte][value][point] sum of their samples
+    vector<int64_t> sum_y, sum_y2;          // [point]
+    
+    // used[s]: some model takes its data from source s
+    cpa_accumulator(int points, const bool* used) : points(points), stride(points), count(0),
+                                                    sum_y(points), sum_y2(points)
+    {
+        for (int s = 0; s < LEAK_SOURCES; s++)
+            if (used[s])
+            {
+                counts[s].resize(16 * 256);
+                sums  [s].resize(16 * 256 * (size_t) points);
+            }
+    }
+    
+    // adds the traces first to traces.traces() - 1 of the matrix, of the
+    // messages ms encrypted into cs (byte n of the data is the one mixed
+    // with byte n of a round key); a point at a time, in parallel, the
+    // samples of a point being contiguous in the matrix
+    void fold(const trace_matrix &traces, size_t first, const vector<aes_block> &ms, const vector<aes_block> &cs)
+    {
+        int num = traces.traces() - first;
+        const vector<aes_block>* data[LEAK_SOURCES] = { &ms, &cs };
+        
+        count += num;
+        for (int s = 0; s < LEAK_SOURCES; s++)
+            if (!sums[s].empty())
+                for (int j = 0; j < num; j++)
+                    for (int n = 0; n < 16; n++)
+                        counts[s][n*256 + (*data[s])[j].b[n]]++;
+        
+        #pragma omp parallel for
+        for (int i = 0; i < points; i++)
+        {
+            const int16_t* y = traces.row(i) + first;
+            for (int j = 0; j < num; j++)
+            {
+                sum_y [i] += y[j];
+                sum_y2[i] += (int64_t) y[j] * y[j];
+            }
+            for (int s = 0; s < LEAK_SOURCES; s++)
+                if (!sums[s].empty())
+                    for (int n = 0; n < 16; n++)
+                        for (int j = 0; j < num; j++)
+                            sums[s][(n*256 + (*data[s])[j].b[n]) * (size_t) stride + i] += y[j];
+        }
+    }
     
-    // only need the first 10% of a power
-    // and ignore the rest of the input
-    vector<int> current_power(length/10);
-    for (int i = 0; i < length/10; i++)
-        gmp_fscanf(target_out, ",%d", &current_power[i]);
-    gmp_fscanf(target_out, "%*[^\n]");
+    // row length of the correlation matrices: the points padded for gemm
+    int width() const { return (points + GEMM_NR - 1) / GEMM_NR * GEMM_NR; }
+    
+    // best correlation over the points of every guess of every byte,
+    // for every model: peaks[model][byte][guess]
+    // with x and y standardized, the correlation is the mean of their
+    // product over the traces; summed per value of the data byte it
+    // becomes a product of the 256 x 256 matrix of standardized
+    // hypotheses (guess, value) and the 256 x points matrix of the
+    // standardized sums of the samples per value
+    // the products are tiled over (data byte, CPA_TILE points, CPA_GUESSES
+    // guesses): a tile of the standardized sums is built once and stays
+    // in the L2 cache while every model goes past it a block of guesses at
+    // a time, and only the best correlation of every guess leaves the
+    // tile; the statistics of every point and the standardized hypotheses
+    // of every model and byte are computed once, before the tiles, and
+    // shared by all of them
+    void best_correlations(const vector<leakage_model> &models, vector< array<float[256], 16> > &peaks) const
+    {
+        int ld = width(), tiles = (ld + CPA_TILE - 1) / CPA_TILE;
+        int num = models.size();
+        
+        // statistics of every point
+        vector<double> mean_y(points), scale_y(points);
+        for (int i = 0; i < points; i++)
+        {
+            mean_y[i] = (double) sum_y[i] / count;
+            double sd_y = sqrt(std::max(0.0, (double) sum_y2[i] / count - mean_y[i] * mean_y[i]));
+            scale_y[i] = sd_y > 0 ? 1 / (count * sd_y) : 0;
+        }
+        
+        // standardized hypotheses of every model and byte
+        vector< vector<float> > hyp(num * 16);
+        #pragma omp parallel for collapse(2)
+        for (int l = 0; l < num; l++)
+            for (int n = 0; n < 16; n++)
+            {
+                const vector<long> &counts = this->counts[models[l].source];
+                vector<float> &h = hyp[l*16 + n];
+                h.resize(256 * 256);
+                for (int k = 0; k < 256; k++)
+                {
+                    const int8_t* x_k = models[l].hyp + 256*k;
+                    double sum_x = 0, sum_x2 = 0;
+                    for (int v = 0; v < 256; v++)
+                    {
+                        int x = x_k[v];
+                        long c = counts[n*256 + v];
+                        sum_x  += c * x;
+                        sum_x2 += c * x * x;
+                    }
+                    double mean_x = sum_x / count;
+                    double sd_x = sqrt(std::max(0.0, sum_x2 / count - mean_x * mean_x));
+                    for (int v = 0; v < 256; v++)
+                        h[k*256 + v] = sd_x > 0 ? (x_k[v] - mean_x) / sd_x : 0;
+                }
+            }
+        
+        // the tiles of the data the models use; the best correlation of
+        // every tile, reduced over the tiles afterwards
+        vector<int> work;
+        for (int s = 0; s < LEAK_SOURCES; s++)
+            if (!sums[s].empty())
+                for (int n = 0; n < 16; n++)
+                    for (int t = 0; t < tiles; t++)
+                        work.push_back((s * 16 + n) * tiles + t);
+        vector<float> best(num * 16 * (size_t) tiles * 256);
+        
+        #pragma omp parallel for schedule(dynamic)
+        for (int w = 0; w < work.size(); w++)
+        {
+            int s = work[w] / tiles / 16, n = work[w] / tiles % 16, t = work[w] % tiles;
+            int i0 = t * CPA_TILE, cols = std::min(CPA_TILE, ld - i0), valid = std::min(CPA_TILE, points - i0);
+            
+            // standardized sums of the samples per value, for the tile
+            vector<float> ys(256 * (size_t) CPA_TILE, 0), corr(CPA_GUESSES * (size_t) CPA_TILE);
+            for (int v = 0; v < 256; v++)
+            {
+                const int32_t* sum = &sums[s][(n*256 + v) * (size_t) stride + i0];
+                double c = counts[s][n*256 + v];
+                float* y = &ys[v * (size_t) CPA_TILE];
+                for (int i = 0; i < valid; i++)
+                    y[i] = (sum[i] - c * mean_y[i0 + i]) * scale_y[i0 + i];
+            }
+            
+            for (int l = 0; l < num; l++)
+            {
+                if (models[l].source != s)
+                    continue;
+                for (int k0 = 0; k0 < 256; k0 += CPA_GUESSES)
+                {
+                    gemm(CPA_GUESSES, cols, 256, hyp[l*16 + n].data() + k0 * 256, 256,
+                         ys.data(), CPA_TILE, corr.data(), CPA_TILE);
+                    float* b = &best[((l*16 + n) * (size_t) tiles + t) * 256 + k0];
+                    for (int k = 0; k < CPA_GUESSES; k++)
+                    {
+                        float max_abs = 0;
+                        for (int i = 0; i < valid; i++)
+                            max_abs = std::max(max_abs, std::abs(corr[k * (size_t) CPA_TILE + i]));
+                        b[k] = max_abs;
+                    }
+                }
+            }
+        }
+        
+        peaks.resize(num);
+        for (int l = 0; l < num; l++)
+            for (int n = 0; n < 16; n++)
+                for (int k = 0; k < 256; k++)
+                {
+                    float max_abs = 0;
+                    for (int t = 0; t < tiles; t++)
+                        max_abs = std::max(max_abs, best[((l*16 + n) * (size_t) tiles + t) * 256 + k]);
+                    peaks[l][n][k] = max_abs;
+                }
+    }
+};
+
+// alignment of the traces on a pattern of the reference trace (its first
+// ALIGN_LENGTH samples), for targets whose traces jitter in time
+// every trace is shifted by the lag, at most ALIGN_LAG either way, where
+// its cross-correlation with the pattern peaks; the cross-correlation at
+// all the lags at once comes from a product of Fourier transforms, the
+// transform of the pattern being computed once
+#define ALIGN_LENGTH 2048
+#define ALIGN_LAG    256
+
+// in-place radix-2 Fourier transform, a.size() a power of 2
+static void fft(vector< complex<float> > &a, bool inverse)
+{
+    int size = a.size();
+    for (int i = 1, j = 0; i < size; i++)
+    {
+        int bit = size >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(a[i], a[j]);
+    }
     
-    gmp_fscanf(target_out, "%ZX", c.get_mpz_t());
-    interaction_number++;
-    return current_power;
+    for (int len = 2; len <= size; len <<= 1)
+    {
+        double angle = 2 * M_PI / len * (inverse ? 1 : -1);
+        complex<float> step(cos(angle), sin(angle));
+        for (int i = 0; i < size; i += len)
+        {
+            complex<float> w(1);
+            for (int j = 0; j < len / 2; j++)
+            {
+                complex<float> u = a[i + j], v = a[i + j + len/2] * w;
+                a[i + j] = u + v;
+                a[i + j + len/2] = u - v;
+                w *= step;
+            }
+        }
+    }
 }
 
-// Straight-forward mean fucntion used in the corrcoef function
-float mean(vector<int> trace)
+struct trace_aligner
 {
-    float sum = 0;
+    int length, size;
+    vector< complex<float> > pattern;   // conjugated transform of the pattern
+    
+    trace_aligner(const vector<int16_t> &reference)
+    {
+        length = std::min(ALIGN_LENGTH, (int) reference.size());
+        for (size = 1; size < length + 2 * ALIGN_LAG; size <<= 1)
+            ;
+        
+        double mean = 0;
+        for (int i = 0; i < length; i++)
+            mean += reference[i] / (double) length;
+        pattern.assign(size, 0);
+        for (int i = 0; i < length; i++)
+            pattern[i] = reference[i] - mean;
+        fft(pattern, false);
+        for (int i = 0; i < size; i++)
+            pattern[i] = conj(pattern[i]);
+    }
     
-    for (int i = 0; i < trace.size(); i++)
-        sum += trace[i];
+    // the lag by which the trace is late: trace[i + lag] matches reference[i]
+    int lag(const vector<int16_t> &trace) const
+    {
+        return lag(trace.data(), trace.size());
+    }
     
-    return (float) sum/trace.size();
+    int lag(const int16_t* trace, int samples) const
+    {
+        // the trace from ALIGN_LAG samples before the pattern, so that
+        // the lag l lands at ALIGN_LAG + l
+        int num = std::min(length + ALIGN_LAG, samples);
+        double mean = 0;
+        for (int i = 0; i < num; i++)
+            mean += trace[i] / (double) num;
+        vector< complex<float> > a(size, 0);
+        for (int i = 0; i < num; i++)
+            a[ALIGN_LAG + i] = trace[i] - mean;
+        
+        fft(a, false);
+        for (int i = 0; i < size; i++)
+            a[i] *= pattern[i];
+        fft(a, true);
+        
+        int best = ALIGN_LAG;
+        for (int i = 0; i <= 2 * ALIGN_LAG; i++)
+            if (a[i].real() > a[best].real())
+                best = i;
+        return best - ALIGN_LAG;
+    }
+};
+
+int trace_sink::keep(const int16_t* samples, int num, size_t j) const
+{
+    // the sample at point i of the trace shifted by its lag; a trace cut
+    // short repeats its last sample
+    int lag = aligner != NULL ? aligner->lag(samples, num) : 0;
+    for (int i = 0; i < points->size(); i++)
+    {
+        int p = std::min((*points)[i], num - 1) + lag;
+        traces->row(i)[j] = samples[std::max(0, std::min(num - 1, p))];
+    }
+    return lag;
 }
 
-// Pearson Product-Moment Correlation a.k.a. 
-// Pearson's correlation coefficient
-float corrcoef(vector<int> x, vector<int> y)
+// shifts every trace by its lag, in parallel; the samples past either
+// end repeat the ones at the end
+void align(const trace_aligner &aligner, vector< vector<int16_t> > &powers, vector<int> &lags)
 {
-    // initialise: cov_xy is at the top, the other two - at the bottom
-    float cov_xy = 0, sum_x = 0, sum_y = 0;
-    
-    // precompute for efficiency
-    float mean_x = mean(x);
-    float mean_y = mean(y);
+    lags.resize(powers.size());
+    #pragma omp parallel for
+    for (int j = 0; j < powers.size(); j++)
+    {
+        int lag = lags[j] = aligner.lag(powers[j]);
+        if (lag == 0)
+            continue;
+        int num = powers[j].size();
+        vector<int16_t> shifted(num);
+        for (int i = 0; i < num; i++)
+            shifted[i] = powers[j][std::max(0, std::min(num - 1, i + lag))];
+        powers[j].swap(shifted);
+    }
+}
+
+// ranking of the guesses of every key byte, and of the whole keys
+// the score of a guess is its log-likelihood, which normalized over the
+// 256 guesses becomes a log-probability; for the CPA the best
+// correlation r over the points becomes one through the Fisher transform
+// z = atanh(r) sqrt(N - 3), the likelihood being exp(z²/2)
+// the rank of the key is estimated from these probabilities (histogram
+// convolution): the distribution of the log-probabilities of all the
+// 2^128 keys is the convolution of the distributions of the 16 bytes,
+// and the expected rank of the key is the probability of every bin of
+// it times the number of keys more likely than the bin
+#define RANK_BINS 256
+
+struct key_ranking
+{
+    unsigned char guess[16][256];   // guesses of every byte, best first
+    double logp[16][256];           // and their log-probabilities
+    double margin[16];              // score of the best guess minus the second
+    double log2_rank;               // log2 of the expected rank of the key
+};
+
+void rank_scores(const double scores[16][256], key_ranking &r)
+{
+    double width = 0;
+    for (int n = 0; n < 16; n++)
+    {
+        const double* score = scores[n];
+        double top = *std::max_element(score, score + 256);
+        
+        double sum = 0;
+        for (int k = 0; k < 256; k++)
+            sum += exp(score[k] - top);
+        
+        for (int k = 0; k < 256; k++)
+            r.guess[n][k] = k;
+        std::sort(r.guess[n], r.guess[n] + 256, [&score](unsigned char a, unsigned char b) { return score[a] > score[b]; });
+        for (int k = 0; k < 256; k++)
+            r.logp[n][k] = score[r.guess[n][k]] - top - log(sum);
+        r.margin[n] = score[r.guess[n][0]] - score[r.guess[n][1]];
+        
+        width = std::max(width, -r.logp[n][255] / (RANK_BINS - 1));
+    }
+    if (width == 0)
+        width = 1;
     
-    for (int i = 0; i < x.size(); i++)
-        cov_xy += (x[i] - mean_x)*(y[i] - mean_y);
+    // number of keys and probability in every bin of their log-probability
+    vector<double> count(1, 1), mass(1, 1);
+    for (int n = 0; n < 16; n++)
+    {
+        vector<double> count_n(RANK_BINS), mass_n(RANK_BINS);
+        for (int k = 0; k < 256; k++)
+        {
+            int bin = std::min(RANK_BINS - 1, (int) (-r.logp[n][k] / width));
+            count_n[bin] += 1;
+            mass_n[bin] += exp(r.logp[n][k]);
+        }
+        
+        vector<double> count_c(count.size() + RANK_BINS - 1), mass_c(count.size() + RANK_BINS - 1);
+        for (int a = 0; a < count.size(); a++)
+            for (int b = 0; b < RANK_BINS; b++)
+            {
+                count_c[a + b] += count[a] * count_n[b];
+                mass_c [a + b] += mass [a] * mass_n [b];
+            }
+        count.swap(count_c);
+        mass.swap(mass_c);
+    }
     
-    for (int i = 0; i < x.size(); i++)
-        sum_x += (x[i] - mean_x)*(x[i] - mean_x);    
+    // bins are in decreasing probability: the keys more likely than a
+    // bin are the ones before it, and half of the ones within it
+    double rank = 0, before = 0;
+    for (int b = 0; b < count.size(); b++)
+    {
+        rank += mass[b] * (before + count[b] / 2);
+        before += count[b];
+    }
+    r.log2_rank = log2(std::max(1.0, rank));
+}
+
+void rank_keys(const float peaks[16][256], long traces, key_ranking &r)
+{
+    double scale = sqrt(std::max(1.0, traces - 3.0));
     
-    for (int i = 0; i < y.size(); i++)
-        sum_y += (y[i] - mean_y)*(y[i] - mean_y);
+    double scores[16][256];
+    for (int n = 0; n < 16; n++)
+        for (int k = 0; k < 256; k++)
+        {
+            double z = atanh(std::min(peaks[n][k], 0.9999f)) * scale;
+            scores[n][k] = z * z / 2;
+        }
+    rank_scores(scores, r);
     
-    return (float) cov_xy/(sqrt(sum_x)*sqrt(sum_y));
+    // the margins as correlations
+    for (int n = 0; n < 16; n++)
+        r.margin[n] = peaks[n][r.guess[n][0]] - peaks[n][r.guess[n][1]];
 }
 
-void attack(char* argv2)
+// bounded enumeration of the keys in decreasing probability, at most
+// budget of them, each checked by encrypting m; true with the key which
+// encrypts m into c
+// the keys are ranks of guesses for every byte; a key is expanded into:
+// its last rank moved one further, a rank 1 set at the next byte, and
+// when its last rank is 1, that rank moved to the next byte instead;
+// with the bytes in increasing order of the loss from their best guess
+// to their second, every key has a single parent, less likely than it,
+// so a heap pops the keys in order and holds at most 3 per key popped
+// the keys are checked ENUM_BATCH at a time, in parallel groups of
+// AES_BATCH keys for the batch verifier
+#define ENUM_BATCH 1024
+#define ENUM_LOG2_BUDGET 24
+
+struct enum_state
 {
-    // count the number of interactions with the target
-    unsigned int interaction_number = 0;
+    double logp;
+    unsigned char rank[16];   // rank of the guess of every byte, in the order of the bytes
+    signed char last;         // last byte whose rank is set, -1 for none
     
-    // declare variables for communication with the target
-    mpz_class c, m;
-    vector<int> current_power;
-    vector<mpz_class> messages;
-    int oracle_queries = 10;
+    bool operator<(const enum_state &s) const { return logp < s.logp; }
+};
+
+bool enumerate_keys(const key_ranking &r, bool last_round, const aes_block &m, const aes_block &c,
+                    long budget, unsigned char* key, long &tried)
+{
+    // byte order: increasing loss from the best guess to the second
+    int order[16];
+    for (int n = 0; n < 16; n++)
+        order[n] = n;
+    std::sort(order, order + 16, [&r](int a, int b) { return r.logp[a][0] - r.logp[a][1] < r.logp[b][0] - r.logp[b][1]; });
     
-    // produce random messages
-    gmp_randclass randomness(gmp_randinit_default);
+    std::priority_queue<enum_state> heap;
+    enum_state top;
+    top.logp = 0;
+    for (int n = 0; n < 16; n++)
+        top.logp += r.logp[n][0];
+    memset(top.rank, 0, 16);
+    top.last = -1;
+    heap.push(top);
     
-    // a 2D matrix of traces/powers
-    vector< vector<int> > powers;
+    auto set = [&](enum_state &s, int pos, int rank)
+    {
+        int n = order[pos];
+        s.logp += r.logp[n][rank] - r.logp[n][s.rank[pos]];
+        s.rank[pos] = rank;
+    };
     
-    RESAMPLE:
-    // initial sample set and respective power traces
-    for (int j = 0; j < oracle_queries; j++)
+    tried = 0;
+    bool found = false;
+    while (!found && tried < budget && !heap.empty())
     {
-        // compute a random message
-        m = randomness.get_z_bits(128);
-        messages.push_back(m);
+        vector< array<unsigned char, 16> > batch;
+        while (batch.size() < ENUM_BATCH && tried + batch.size() < budget && !heap.empty())
+        {
+            enum_state s = heap.top();
+            heap.pop();
+            
+            array<unsigned char, 16> k;
+            for (int pos = 0; pos < 16; pos++)
+                k[order[pos]] = r.guess[order[pos]][s.rank[pos]];
+            batch.push_back(k);
+            
+            int j = s.last;
+            if (j >= 0 && s.rank[j] < 255)
+            {
+                enum_state t = s;
+                set(t, j, s.rank[j] + 1);
+                heap.push(t);
+            }
+            if (j + 1 < 16)
+            {
+                enum_state t = s;
+                t.last = j + 1;
+                set(t, j + 1, 1);
+                heap.push(t);
+                if (j >= 0 && s.rank[j] == 1)
+                {
+                    set(t, j, 0);
+                    heap.push(t);
+                }
+            }
+        }
         
-        // find the power trace while encrypting it
-        current_power = interact(m, c, interaction_number);
-        powers.push_back(current_power);   
+        // the candidates are verified AES_BATCH at a time, each group by
+        // the batch verifier and the groups in parallel
+        int hit = -1;
+        int groups = (batch.size() + AES_BATCH - 1) / AES_BATCH;
+        #pragma omp parallel for
+        for (int g = 0; g < groups; g++)
+        {
+            int first = g * AES_BATCH, num = std::min((int) batch.size() - first, AES_BATCH);
+            unsigned char k[AES_BATCH][16];
+            for (int i = 0; i < num; i++)
+                if (last_round)
+                    aes_first_round_key(batch[first + i].data(), k[i]);
+                else
+                    memcpy(k[i], batch[first + i].data(), 16);
+            
+            int i = aes_verify(k, num, m.b, c.b);
+            if (i >= 0)
+            {
+                #pragma omp critical
+                if (hit < 0 || first + i < hit)
+                {
+                    hit = first + i;
+                    memcpy(key, k[i], 16);
+                }
+            }
+        }
+        found = hit >= 0;
+        tried += found ? hit + 1 : batch.size();
     }
+    return found;
+}
 
-    // find the smallest by size power
-    int min = powers[0].size();
-    for (int j = 1; j < powers.size(); j++)
-        if (powers[j].size() < min)
-            min = powers[j].size();
+// points of interest, from a pilot set of traces acquired in full:
+// - the points which depend on the data at all are the ones where the
+//   traces vary POI_NOISE times more than at the median point, which
+//   only carries noise
+// - these are correlated with the hypotheses of every model, straight
+//   from the traces (a product of the standardized hypotheses, guesses
+//   x traces, and of the standardized traces, traces x points), and the
+//   POI_POINTS points where the best guess of a key byte correlates the
+//   most are kept for that byte
+// variance alone is not enough since every round of AES depends on the
+// data, and the correlation alone picks the noise of flat points, where
+// a few traces easily match some guess
+// the points come back in increasing order
+#define POI_PILOT  10
+#define POI_NOISE  8
+#define POI_POINTS 32
+#define POI_BLOCK  4096
+
+// mean and variance of every point of the pilot traces, and the floor
+// the variance of a point has to pass for the point to depend on the data
+static double point_statistics(const trace_matrix &pilot, vector<double> &mean, vector<double> &variance)
+{
+    int num = pilot.traces();
+    int length = pilot.points();
     
-    vector< vector<int> > powers_T(min, vector<int> (powers.size()));   //the 'transposed' matrix
-    for (int j = 0; j < min; j++)  
-        for (int l = 0; l < powers.size(); l++)
-	        powers_T[j][l] = powers[l][j];
-        
-    vector<unsigned char> key(16);
-   
-    // recover 1 byte of the key at the time: 
-    // 1 byte of the key corresponds to 1 byte of the message in AES
-    // there are 256 possible values for this byte
+    mean.resize(length);
+    variance.resize(length);
     #pragma omp parallel for
-    for (int n = 0; n < 16; n++)
+    for (int i = 0; i < length; i++)
     {
-        // simulated power traces
-        vector< vector<int> > target   (messages.size(), vector<int> (256));
-        vector< vector<int> > target_T (256, vector<int> (messages.size()));
+        const int16_t* y = pilot.row(i);
+        double sum = 0, sum2 = 0;
+        for (int j = 0; j < num; j++)
+        {
+            sum  += y[j];
+            sum2 += (double) y[j] * y[j];
+        }
+        mean[i] = sum / num;
+        variance[i] = std::max(0.0, sum2 / num - mean[i] * mean[i]);
+    }
+    
+    vector<double> sorted(variance);
+    std::nth_element(sorted.begin(), sorted.begin() + length / 2, sorted.end());
+    return POI_NOISE * sorted[length / 2];
+}
 
-        // power traces of the same messages simulation
-        for (int j = 0; j < messages.size(); j++)
+vector<int> select_points(const trace_matrix &pilot, const vector<aes_block> &ms,
+                          const vector<aes_block> &cs, const vector<leakage_model> &models)
+{
+    int num = pilot.traces();
+    int length = pilot.points();
+    int ld = (length + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+    
+    vector<double> mean, variance;
+    double floor = point_statistics(pilot, mean, variance);
+    
+    // standardized traces, shared by every model and byte; the points
+    // left out stay zero and never correlate
+    vector<float> ys(num * (size_t) ld);
+    #pragma omp parallel for
+    for (int i = 0; i < length; i++)
+        if (variance[i] > floor)
+            for (int j = 0; j < num; j++)
+                ys[j * (size_t) ld + i] = (pilot.row(i)[j] - mean[i]) / (sqrt(variance[i]) * num);
+    
+    // points kept for every model and byte
+    vector< vector<int> > chosen(models.size() * 16);
+    #pragma omp parallel for collapse(2)
+    for (int l = 0; l < models.size(); l++)
+        for (int n = 0; n < 16; n++)
         {
-            mpz_class temp = messages[j] >> (8*n);
-            int current_byte = temp.get_si() & 0xff;
-            // bitxor each byte of each message with each possible value for the key
+            const vector<aes_block> &data = models[l].source == LEAK_MESSAGE ? ms : cs;
+            
+            // standardized hypotheses of every guess for the pilot traces
+            vector<float> hyp(256 * (size_t) num);
             for (int k = 0; k < 256; k++)
-                // Differential part of DPA: XOR -> SBox -> Hamming Weight
-                target[j][k] = HammingWeight[SubBytes[current_byte ^ k]];
-        }
-        
-        // transpose target into target_T
-        for (int j = 0; j < 256; j++)  
-            for (int l = 0; l < target.size(); l++)
-                target_T[j][l] = target[l][j];
-        
-        // compute a matrix of all correlation coefficients of target and powers
-        vector< vector<float> > corr_mat (256, vector<float> (powers_T.size()));
-        for (int j = 0; j < 256; j++)
-            for (int l = 0; l < powers_T.size(); l++)
             {
-                if (powers_T[l].size() != target_T[j].size())
-                    continue;
-                
-                corr_mat[j][l] = corrcoef(target_T[j], powers_T[l]);
+                double sum = 0, sum2 = 0;
+                for (int j = 0; j < num; j++)
+                {
+                    int x = models[l].hyp[256*k + data[j].b[n]];
+                    sum += x;
+                    sum2 += x * x;
+                }
+                double mean = sum / num;
+                double sd = sqrt(std::max(0.0, sum2 / num - mean * mean));
+                for (int j = 0; j < num; j++)
+                    hyp[k * (size_t) num + j] = sd > 0 ? (models[l].hyp[256*k + data[j].b[n]] - mean) / sd : 0;
             }
-        
-        // find the best correlation and the respective byte value
-        float max_abs = -2;
-        int max_j = -1;
-        for (int j = 0; j < 256; j++)
-            for (int l = 0; l < powers_T.size(); l++)
-                if(abs(corr_mat[j][l]) > max_abs)
+            
+            // best correlation of any guess at every point, a block of
+            // points at a time
+            vector<float> best(length), corr(256 * (size_t) POI_BLOCK);
+            for (int i0 = 0; i0 < ld; i0 += POI_BLOCK)
+            {
+                int width = std::min(POI_BLOCK, ld - i0);
+                gemm(256, width, num, hyp.data(), num, ys.data() + i0, ld, corr.data(), POI_BLOCK);
+                for (int i = i0; i < std::min(length, i0 + width); i++)
                 {
-                    max_abs = abs(corr_mat[j][l]);
-                    max_j = j;
+                    float max_abs = 0;
+                    for (int k = 0; k < 256; k++)
+                        max_abs = std::max(max_abs, std::abs(corr[k * (size_t) POI_BLOCK + i - i0]));
+                    best[i] = max_abs;
                 }
-        
-        key[n] = max_j;
+            }
+            
+            vector<int> order(length);
+            for (int i = 0; i < length; i++)
+                order[i] = i;
+            int top = std::min(POI_POINTS, length);
+            std::nth_element(order.begin(), order.begin() + top, order.end(),
+                             [&best](int a, int b) { return best[a] > best[b]; });
+            for (int i = 0; i < top; i++)
+                if (best[order[i]] > 0)
+                    chosen[l*16 + n].push_back(order[i]);
+        }
+    
+    vector<int> points;
+    for (int l = 0; l < chosen.size(); l++)
+        points.insert(points.end(), chosen[l].begin(), chosen[l].end());
+    std::sort(points.begin(), points.end());
+    points.erase(std::unique(points.begin(), points.end()), points.end());
+    return points;
+}
+
+// second-order mode, against an implementation with a Boolean mask: the
+// masked value and the mask leak at two different points, and neither
+// correlates with the key on its own while the product of the two,
+// each centered on its mean, does
+// the points are the ORDER2_POINTS which vary the most over the pilot
+// traces (a masked implementation leaves no first-order correlation for
+// the pilot CPA to find), paired with every point at most ORDER2_WINDOW
+// samples after them, itself included, closest pairs first and at most
+// ORDER2_PAIRS of them; every pair then becomes a point of the CPA, its
+// sample the centered product
+// the means are those of the pilot traces, as integers, fixed for the
+// whole attack so that a product folded in is never revisited; an error
+// in a mean only adds the first-order leak of the other point, which a
+// masked implementation does not have
+// the products are shifted right so that those of the pilot traces fit
+// in half of an int16, the rest saturating
+#define ORDER2_POINTS 256
+#define ORDER2_WINDOW 64
+#define ORDER2_PAIRS  4096
+
+struct point_pair { int a, b; };   // indices in the points of interest
+
+vector<int> select_pairs(const trace_matrix &pilot, vector<point_pair> &pairs, vector<int16_t> &means, int &shift)
+{
+    int num = pilot.traces();
+    int length = pilot.points();
+    
+    vector<double> mean, variance;
+    double floor = point_statistics(pilot, mean, variance);
+    
+    vector<int> points;
+    for (int i = 0; i < length; i++)
+        if (variance[i] > floor)
+            points.push_back(i);
+    if (points.size() > ORDER2_POINTS)
+    {
+        std::nth_element(points.begin(), points.begin() + ORDER2_POINTS, points.end(),
+                         [&variance](int a, int b) { return variance[a] > variance[b]; });
+        points.resize(ORDER2_POINTS);
     }
+    std::sort(points.begin(), points.end());
     
-    cout << "\nSuggested Key: ";
-    for (int n = 15; n >= 0; n--)
-        printf("%02X", key[n]);
+    pairs.clear();
+    for (int a = 0; a < points.size(); a++)
+        for (int b = a; b < points.size() && points[b] - points[a] <= ORDER2_WINDOW; b++)
+            pairs.push_back({ a, b });
+    auto distance = [&points](const point_pair &p) { return points[p.b] - points[p.a]; };
+    std::stable_sort(pairs.begin(), pairs.end(),
+                     [&distance](const point_pair &p, const point_pair &q) { return distance(p) < distance(q); });
+    if (pairs.size() > ORDER2_PAIRS)
+        pairs.resize(ORDER2_PAIRS);
+    std::sort(pairs.begin(), pairs.end(),
+              [](const point_pair &p, const point_pair &q) { return p.a != q.a ? p.a < q.a : p.b < q.b; });
     
-    cout << "\nKey check:";
-    std::reverse(begin(key), end(key));
+    means.resize(points.size());
+    for (int i = 0; i < points.size(); i++)
+        means[i] = lround(mean[points[i]]);
     
-    unsigned char t[16];
-
-    //holder for the byte array
-    unsigned char m_char[16] = {0}, c_char[16] = {0};
+    long peak = 0;
+    for (int p = 0; p < pairs.size(); p++)
+        for (int j = 0; j < num; j++)
+        {
+            long x = pilot.row(points[pairs[p].a])[j] - means[pairs[p].a];
+            long y = pilot.row(points[pairs[p].b])[j] - means[pairs[p].b];
+            peak = std::max(peak, std::abs(x * y));
+        }
+    for (shift = 0; (peak >> shift) > 16383; shift++)
+        ;
     
-    // convert m and c from mpz_class to a byte array
-    // have the behaviour of I2OSP
-    mpz_export(m_char, NULL, 1, 1, 0, 0, m.get_mpz_t());
-    mpz_export(c_char, NULL, 1, 1, 0, 0, c.get_mpz_t());
+    return points;
+}
+
+// centered products z[j] = (a[j] - mean_a) * (b[j] - mean_b) >> shift of
+// two rows of samples, saturated to int16
+// 16 samples at a time: the differences are saturated int16 and their
+// product is put together in 32 bits from its low and high halves,
+// shifted and packed back
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void centered_product_avx2(const int16_t* a, int16_t mean_a, const int16_t* b, int16_t mean_b,
+                                  int shift, int16_t* z, int num)
+{
+    const __m256i ma = _mm256_set1_epi16(mean_a), mb = _mm256_set1_epi16(mean_b);
+    const __m128i count = _mm_cvtsi32_si128(shift);
+    int j = 0;
+    for (; j + 16 <= num; j += 16)
+    {
+        __m256i x = _mm256_subs_epi16(_mm256_loadu_si256((const __m256i*) (a + j)), ma);
+        __m256i y = _mm256_subs_epi16(_mm256_loadu_si256((const __m256i*) (b + j)), mb);
+        __m256i lo = _mm256_mullo_epi16(x, y), hi = _mm256_mulhi_epi16(x, y);
+        __m256i p0 = _mm256_sra_epi32(_mm256_unpacklo_epi16(lo, hi), count);
+        __m256i p1 = _mm256_sra_epi32(_mm256_unpackhi_epi16(lo, hi), count);
+        _mm256_storeu_si256((__m256i*) (z + j), _mm256_packs_epi32(p0, p1));
+    }
+    for (; j < num; j++)
+    {
+        int x = max(-32768, min(a[j] - mean_a, 32767));
+        int y = max(-32768, min(b[j] - mean_b, 32767));
+        z[j] = max(-32768, min((x * y) >> shift, 32767));
+    }
+}
+#endif
+
+static void centered_product(const int16_t* a, int16_t mean_a, const int16_t* b, int16_t mean_b,
+                             int shift, int16_t* z, int num)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        return centered_product_avx2(a, mean_a, b, mean_b, shift, z, num);
+#endif
+    for (int j = 0; j < num; j++)
+    {
+        int x = max(-32768, min(a[j] - mean_a, 32767));
+        int y = max(-32768, min(b[j] - mean_b, 32767));
+        z[j] = max(-32768, min((x * y) >> shift, 32767));
+    }
+}
+
+// the centered products of every pair for the traces first to
+// traces.traces() - 1, as the traces of the products matrix: a pair at a
+// time, in parallel, the two rows and the row of products contiguous
+void combine_pairs(const trace_matrix &traces, size_t first, const vector<point_pair> &pairs,
+                   const vector<int16_t> &means, int shift, trace_matrix &products)
+{
+    int num = traces.traces() - first;
+    products.reset(pairs.size());
+    products.extend(num);
     
-    AES_KEY rk;
-    AES_set_encrypt_key(key.data(), 128, &rk);
-    AES_encrypt(m_char, t, &rk);  
+    #pragma omp parallel for
+    for (int p = 0; p < pairs.size(); p++)
+        centered_product(traces.row(pairs[p].a) + first, means[pairs[p].a],
+                         traces.row(pairs[p].b) + first, means[pairs[p].b], shift, products.row(p), num);
+}
 
-    if(!memcmp(t, c_char, 16))
-        printf("\nAES.Enc( k, m ) == c\n");
-    else
+// template attack, with a replica of the target which encrypts under
+// keys of the attacker's choice: the power at a few points of every key
+// byte is modelled, for every Hamming Weight class of its first SubBytes
+// output, as a multivariate Gaussian (a mean per class and a covariance
+// pooled over the classes), then the traces of the target are scored by
+// the log-likelihood of the class every guess puts them in
+// profiling:
+// - the replica encrypts messages chosen so that every byte lands in
+//   every class equally often, under random keys
+// - TEMPLATE_PILOT traces are acquired in full: the TEMPLATE_POINTS
+//   points of a byte are the ones which correlate the most with its
+//   class, among those passing the variance floor of the points of
+//   interest
+// - the rest of the TEMPLATE_TRACES traces are only read up to the last
+//   point, TEMPLATE_BATCH at a time, and only their samples at the points
+//   are kept
+// a few target traces are usually enough, where the CPA needs tens
+#define TEMPLATE_PILOT   64
+#define TEMPLATE_TRACES  1024
+#define TEMPLATE_BATCH   256
+#define TEMPLATE_POINTS  4
+#define TEMPLATE_CLASSES 9
+
+struct gaussian_templates
+{
+    int points[16][TEMPLATE_POINTS];                            // samples of every byte
+    double mean[16][TEMPLATE_CLASSES][TEMPLATE_POINTS];
+    double precision[16][TEMPLATE_POINTS][TEMPLATE_POINTS];     // inverse of the pooled covariance
+};
+
+// class of every byte of the profiling traces: the Hamming Weight of
+// the SubBytes output of the message byte and the key byte
+static void template_classes(const vector<aes_block> &ms, const vector<aes_block> &ks, vector<unsigned char> &classes)
+{
+    classes.resize(16 * ms.size());
+    for (int j = 0; j < ms.size(); j++)
+        for (int n = 0; n < 16; n++)
+            classes[j*16 + n] = HammingWeight[SubBytes[ms[j].b[n] ^ ks[j].b[n]]];
+}
+
+// the TEMPLATE_POINTS points of every byte, from the pilot traces and
+// their classes: the correlation of every byte with every point is a
+// product of the standardized classes (bytes x traces) and of the
+// standardized traces (traces x points), a block of points at a time
+static void template_points(const trace_matrix &pilot, const vector<unsigned char> &classes, gaussian_templates &t)
+{
+    int num = pilot.traces();
+    int length = pilot.points();
+    int ld = (length + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+    
+    vector<double> mean, variance;
+    double floor = point_statistics(pilot, mean, variance);
+    
+    vector<float> ys(num * (size_t) ld);
+    #pragma omp parallel for
+    for (int i = 0; i < length; i++)
+        if (variance[i] > floor)
+            for (int j = 0; j < num; j++)
+                ys[j * (size_t) ld + i] = (pilot.row(i)[j] - mean[i]) / (sqrt(variance[i]) * num);
+    
+    vector<float> hyp(16 * (size_t) num);
+    for (int n = 0; n < 16; n++)
     {
-        printf("\nAES.Enc( k, m ) != c\n");
-        printf("RESAMPLING\n");
-        oracle_queries = 5;
-        goto RESAMPLE;
+        double sum = 0, sum2 = 0;
+        for (int j = 0; j < num; j++)
+        {
+            sum  += classes[j*16 + n];
+            sum2 += classes[j*16 + n] * classes[j*16 + n];
+        }
+        double mean = sum / num;
+        double sd = sqrt(std::max(0.0, sum2 / num - mean * mean));
+        for (int j = 0; j < num; j++)
+            hyp[n * (size_t) num + j] = sd > 0 ? (classes[j*16 + n] - mean) / sd : 0;
     }
     
-    cout << "\nNumber of interactions with the target: " << interaction_number << "\n\n";
+    vector<float> corr(16 * (size_t) ld);
+    #pragma omp parallel for
+    for (int i0 = 0; i0 < ld; i0 += POI_BLOCK)
+        gemm(16, std::min(POI_BLOCK, ld - i0), num, hyp.data(), num, ys.data() + i0, ld, corr.data() + i0, ld);
+    
+    for (int n = 0; n < 16; n++)
+    {
+        const float* c = &corr[n * (size_t) ld];
+        vector<int> order(length);
+        for (int i = 0; i < length; i++)
+            order[i] = i;
+        std::partial_sort(order.begin(), order.begin() + TEMPLATE_POINTS, order.end(),
+                          [c](int a, int b) { return std::abs(c[a]) > std::abs(c[b]); });
+        for (int p = 0; p < TEMPLATE_POINTS; p++)
+            t.points[n][p] = order[p];
+    }
+}
 
+// inverse of a small symmetric positive definite matrix, by Gauss-Jordan
+// elimination (the matrix is regularized beforehand)
+static void invert(double a[TEMPLATE_POINTS][TEMPLATE_POINTS], double inv[TEMPLATE_POINTS][TEMPLATE_POINTS])
+{
+    const int d = TEMPLATE_POINTS;
+    for (int i = 0; i < d; i++)
+        for (int j = 0; j < d; j++)
+            inv[i][j] = i == j;
+    for (int i = 0; i < d; i++)
+    {
+        int pivot = i;
+        for (int r = i + 1; r < d; r++)
+            if (std::abs(a[r][i]) > std::abs(a[pivot][i]))
+                pivot = r;
+        for (int j = 0; j < d; j++)
+        {
+            std::swap(a[i][j], a[pivot][j]);
+            std::swap(inv[i][j], inv[pivot][j]);
+        }
+        double f = 1 / a[i][i];
+        for (int j = 0; j < d; j++)
+        {
+            a[i][j] *= f;
+            inv[i][j] *= f;
+        }
+        for (int r = 0; r < d; r++)
+            if (r != i)
+            {
+                double g = a[r][i];
+                for (int j = 0; j < d; j++)
+                {
+                    a[r][j] -= g * a[i][j];
+                    inv[r][j] -= g * inv[i][j];
+                }
+            }
+    }
 }
 
+// the means and the pooled covariance of every byte, from the samples of
+// the profiling traces at its points (row 16 * n + p of the matrix holds
+// point p of byte n for all the traces); a byte at a time, in parallel,
+// over the contiguous samples of its points
+// the covariance is regularized by a small ridge, since points next to
+// each other often carry the same leak
+static void template_estimate(const trace_matrix &profiled, const vector<unsigned char> &classes, gaussian_templates &t)
+{
+    const int d = TEMPLATE_POINTS;
+    int num = profiled.traces();
+    
+    #pragma omp parallel for
+    for (int n = 0; n < 16; n++)
+    {
+        long count[TEMPLATE_CLASSES] = { 0 };
+        double sum[TEMPLATE_CLASSES][TEMPLATE_POINTS] = { { 0 } };
+        for (int j = 0; j < num; j++)
+            count[classes[j*16 + n]]++;
+        for (int p = 0; p < d; p++)
+        {
+            const int16_t* y = profiled.row(n*d + p);
+            for (int j = 0; j < num; j++)
+                sum[classes[j*16 + n]][p] += y[j];
+        }
+        for (int c = 0; c < TEMPLATE_CLASSES; c++)
+            for (int p = 0; p < d; p++)
+                t.mean[n][c][p] = count[c] > 0 ? sum[c][p] / count[c] : 0;
+        
+        // samples centered on the mean of their class
+        vector<double> centered(d * (size_t) num);
+        for (int p = 0; p < d; p++)
+        {
+            const int16_t* y = profiled.row(n*d + p);
+            double* x = &centered[p * (size_t) num];
+            for (int j = 0; j < num; j++)
+                x[j] = y[j] - t.mean[n][classes[j*16 + n]][p];
+        }
+        
+        double cov[TEMPLATE_POINTS][TEMPLATE_POINTS], trace = 0;
+        for (int p = 0; p < d; p++)
+            for (int q = 0; q <= p; q++)
+            {
+                const double* x = &centered[p * (size_t) num];
+                const double* y = &centered[q * (size_t) num];
+                double s = 0;
+                for (int j = 0; j < num; j++)
+                    s += x[j] * y[j];
+                cov[p][q] = cov[q][p] = s / std::max(1, num - TEMPLATE_CLASSES);
+            }
+        for (int p = 0; p < d; p++)
+            trace += cov[p][p];
+        for (int p = 0; p < d; p++)
+            cov[p][p] += 1e-3 * trace / d + 1e-6;
+        invert(cov, t.precision[n]);
+    }
+}
+
+// adds the log-likelihood of every guess of every byte for the traces
+// (their samples at the points of the byte, as for the profiling) of the
+// messages ms: the Mahalanobis distance of a trace to every class, then
+// to every guess the one of its class; a byte at a time, in parallel
+static void template_score(const gaussian_templates &t, const trace_matrix &traces, size_t first,
+                           const vector<aes_block> &ms, double scores[16][256])
+{
+    const int d = TEMPLATE_POINTS;
+    int num = traces.traces() - first;
+    
+    #pragma omp parallel for
+    for (int n = 0; n < 16; n++)
+        for (int j = 0; j < num; j++)
+        {
+            double distance[TEMPLATE_CLASSES];
+            for (int c = 0; c < TEMPLATE_CLASSES; c++)
+            {
+                double x[TEMPLATE_POINTS];
+                for (int p = 0; p < d; p++)
+                    x[p] = traces.row(n*d + p)[first + j] - t.mean[n][c][p];
+                double s = 0;
+                for (int p = 0; p < d; p++)
+                    for (int q = 0; q < d; q++)
+                        s += x[p] * t.precision[n][p][q] * x[q];
+                distance[c] = s;
+            }
+            unsigned char m = ms[j].b[n];
+            for (int k = 0; k < 256; k++)
+                scores[n][k] -= distance[HammingWeight[SubBytes[m ^ k]]] / 2;
+        }
+}
 
-void cleanup(int s) 
+// the samples of a trace at the points of the templates
+static void template_samples(const gaussian_templates &t, const vector<int16_t> &power, int16_t* y)
 {
-	// Close the   buffered communication handles.
-	fclose(target_in);
-	fclose(target_out);
+    int last = power.size() - 1;
+    for (int n = 0; n < 16; n++)
+        for (int p = 0; p < TEMPLATE_POINTS; p++)
+            y[n*TEMPLATE_POINTS + p] = power[std::min(t.points[n][p], last)];
+}
 
-	// Close the unbuffered communication handles.
-	close(target_raw[0]); 
-	close(target_raw[1]); 
-	close(attack_raw[0]); 
-	close(attack_raw[1]); 
+// the attack with templates, built from the replica at path
+void attack_template(char* path, bool aligned)
+{
+    // declare variables for communication with the target
+    aes_block c, m;
+    
+    gmp_randclass randomness(gmp_randinit_default);
+    
+    // one replica for every target, none when replaying a capture: the
+    // profiling traces are then replayed from the capture of the replica
+    trace_attach(replica, replica_replayed, replica_recorded, REPLICA_SUFFIX);
+    if (oracle_replay_path == NULL)
+        spawn_replicas(path, targets_num);
+    
+    // the values of every class
+    vector<unsigned char> values[TEMPLATE_CLASSES];
+    for (int v = 0; v < 256; v++)
+        values[HammingWeight[v]].push_back(v);
+    
+    gaussian_templates* t = new gaussian_templates;
+    trace_aligner* aligner = NULL;
+    trace_matrix profiled;
+    vector<unsigned char> classes;
+    
+    for (int done = 0; done < TEMPLATE_TRACES; )
+    {
+        int num = done == 0 ? TEMPLATE_PILOT : std::min(TEMPLATE_BATCH, TEMPLATE_TRACES - done);
+        
+        // random keys, and the messages putting every byte in a random class
+        vector<aes_block> ms(num), ks(num), cs;
+        for (int j = 0; j < num; j++)
+        {
+            trace_export(ks[j].b, 16, randomness.get_z_bits(128));
+            for (int n = 0; n < 16; n++)
+            {
+                const vector<unsigned char> &v = values[mpz_class(randomness.get_z_range(TEMPLATE_CLASSES)).get_ui()];
+                ms[j].b[n] = InvSubBytes[v[mpz_class(randomness.get_z_range(v.size())).get_ui()]] ^ ks[j].b[n];
+            }
+        }
+        
+        vector< vector<int16_t> > powers;
+        profile(ms, ks, powers, cs);
+        
+        // the traces of the target are aligned on the first one of the replica
+        if (aligned && aligner == NULL)
+            aligner = new trace_aligner(powers[0]);
+        if (aligned)
+        {
+            vector<int> lags;
+            align(*aligner, powers, lags);
+        }
+        
+        vector<unsigned char> classes_new;
+        template_classes(ms, ks, classes_new);
+        classes.insert(classes.end(), classes_new.begin(), classes_new.end());
+        
+        if (done == 0)
+        {
+            trace_matrix pilot;
+            size_t length = powers[0].size();
+            for (int j = 1; j < num; j++)
+                length = std::min(length, powers[j].size());
+            pilot.reset(length);
+            for (int j = 0; j < num; j++)
+                pilot.append(powers[j].data(), length);
+            
+            template_points(pilot, classes_new, *t);
+            int last = 0;
+            for (int n = 0; n < 16; n++)
+                for (int p = 0; p < TEMPLATE_POINTS; p++)
+                    last = std::max(last, t->points[n][p]);
+            power_span = last + 1 + (aligned ? ALIGN_LAG : 0);
+            profiled.reset(16 * TEMPLATE_POINTS);
+            
+            printf("Template points: %d per byte, up to sample %d of %d\n", TEMPLATE_POINTS, last + 1, (int) length);
+        }
+        
+        vector<int16_t> y(16 * TEMPLATE_POINTS);
+        for (int j = 0; j < num; j++)
+        {
+            template_samples(*t, powers[j], y.data());
+            profiled.append(y.data(), y.size());
+        }
+        done += num;
+    }
+    
+    template_estimate(profiled, classes, *t);
+    printf("Templates: %d classes from %zu replica traces\n", TEMPLATE_CLASSES, profiled.traces());
+    
+    // the log-likelihood of every guess over the target traces so far
+    double (*scores)[256] = new double[16][256]();
+    trace_matrix traces;
+    traces.reset(16 * TEMPLATE_POINTS);
+    unsigned char key[16];
+    bool found = false;
+    
+    for (int oracle_queries = 2; !found; oracle_queries = 1)
+    {
+        vector<aes_block> ms_new(oracle_queries), cs_new;
+        for (int j = 0; j < oracle_queries; j++)
+            trace_export(ms_new[j].b, 16, randomness.get_z_bits(128));
+        
+        vector< vector<int16_t> > powers_new;
+        interact(ms_new, powers_new, cs_new);
+        if (aligned)
+        {
+            vector<int> lags;
+            align(*aligner, powers_new, lags);
+        }
+        
+        size_t first = traces.traces();
+        vector<int16_t> y(16 * TEMPLATE_POINTS);
+        for (int j = 0; j < oracle_queries; j++)
+        {
+            template_samples(*t, powers_new[j], y.data());
+            traces.append(y.data(), y.size());
+        }
+        template_score(*t, traces, first, ms_new, scores);
+        
+        m = ms_new.back();
+        c = cs_new.back();
+        
+        key_ranking r;
+        rank_scores(scores, r);
+        
+        cout << "\nSuggested Key: ";
+        for (int n = 0; n < 16; n++)
+            printf("%02X", r.guess[n][0]);
+        printf(" (template, estimated rank 2^%.1f)", r.log2_rank);
+        
+        if (r.log2_rank <= ENUM_LOG2_BUDGET)
+        {
+            long tried;
+            found = enumerate_keys(r, false, m, c, 1L << ENUM_LOG2_BUDGET, key, tried);
+            printf("\nKey check: %ld keys enumerated", tried);
+            printf(found ? "\nAES.Enc( k, m ) == c\n" : "\nAES.Enc( k, m ) != c\n");
+        }
+        
+        if (!found)
+            printf("\nRESAMPLING\n");
+    }
+    
+    cout << "\nKey: ";
+    for (int n = 0; n < 16; n++)
+        printf("%02X", key[n]);
+    cout << "\n";
+    
+    delete[] scores;
+    delete t;
+    delete aligner;
+    
+    printf("\nProfiling: %u traces from the replica\n", replica.queries());
+    cout << "Number of interactions with the target: " << target.queries() << "\n";
+    cout << "Query throughput: " << target.throughput() << " queries/s\n\n";
+}
 
-	// Forcibly terminate the attack target process.
-	if( pid > 0 )
-		kill(pid, SIGKILL);
+void attack(char* argv2)
+{
+    // declare variables for communication with the target
+    aes_block c, m;
+    
+    for (int x = 0; x < 256; x++)
+        InvSubBytes[SubBytes[x]] = x;
+    
+    // options, in the argument separated by commas (an unknown one stops
+    // the attack, an empty one is ignored):
+    // - leakage models to correlate with (hw by default): all of them are
+    //   evaluated on the same traces and every key they suggest is checked
+    // - noalign: the traces are taken as they come, without alignment
+    // - order2: second-order CPA on the centered products of pairs of
+    //   points, against a masked implementation
+    // - template=replica: template attack instead of the CPA, profiled
+    //   with the target replica at that path
+    vector<leakage_model> models;
+    bool used[LEAK_SOURCES] = { false };
+    bool aligned = true, order2 = false;
+    string replica_path;
+    {
+        string list = argv2;
+        for (size_t i = 0, j; i <= list.size(); i = j + 1)
+        {
+            j = list.find(',', i);
+            if (j == string::npos)
+                j = list.size();
+            string option = list.substr(i, j - i);
+            leakage_model model;
+            if (option == "noalign")
+                aligned = false;
+            else if (option == "order2")
+                order2 = true;
+            else if (option.compare(0, 9, "template=") == 0)
+                replica_path = option.substr(9);
+            else if (leakage_named(option, model))
+                models.push_back(model);
+            else if (!option.empty())
+            {
+                fprintf(stderr, "attack: unknown option %s\n", option.c_str());
+                fprintf(stderr, "usage: attack target [hw|hd|lastbyte|id|bit0..bit7|noalign|order2|template=replica][,...]\n");
+                cleanup(SIGINT);
+            }
+        }
+        if (models.empty())
+            models.push_back(leakage<hw_sbox>("hw"));
+        for (int l = 0; l < models.size(); l++)
+            used[models[l].source] = true;
+    }
+    
+    // produce random messages
+    gmp_randclass randomness(gmp_randinit_default);
+    
+    // record the queries to the target or replay them
+    trace_attach(target, replayed, recorded);
+    
+    if (!replica_path.empty())
+        return attack_template(&replica_path[0], aligned);
+    
+    // the pattern the traces are aligned on, from the pilot set, and the
+    // range of the lags over the whole run
+    trace_aligner* aligner = NULL;
+    int lag_min = 0, lag_max = 0;
+    
+    // statistics of all the traces so far at the points of interest,
+    // created with the pilot set, and the traces at these points
+    cpa_accumulator* acc = NULL;
+    vector<int> points;
+    trace_matrix traces;
+    
+    // second order: the pairs of points correlated, the means they are
+    // centered on and the products of the new traces
+    vector<point_pair> pairs;
+    vector<int16_t> means;
+    int shift = 0;
+    trace_matrix products;
+    
+    // the best correlation of every guess of every byte, for every model
+    vector< array<float[256], 16> > peaks;
+    unsigned char key[16];
+    bool found = false;
+    
+    // initial sample set (the pilot set), then a few more traces until
+    // the key is within reach of the enumeration: only the new traces are
+    // folded into the statistics
+    // a second-order attack needs many more traces, its batches grow with
+    // the traces so far
+    for (int oracle_queries = POI_PILOT; !found; oracle_queries = order2 ? std::max(5L, acc->count / 4) : 5)
+    {
+        // compute random messages
+        vector<aes_block> ms_new(oracle_queries), cs_new;
+        for (int j = 0; j < oracle_queries; j++)
+            trace_export(ms_new[j].b, 16, randomness.get_z_bits(128));
+        
+        size_t first = traces.traces();
+        vector<int> lags;
+        
+        // the pilot set is acquired in full, to find the points of
+        // interest; the next traces are only read up to the last point of
+        // interest, and a lag after it, and go straight into the matrix
+        if (acc == NULL)
+        {
+            vector< vector<int16_t> > powers_new;
+            interact(ms_new, powers_new, cs_new);
+            
+            // the traces are aligned on the first one of the pilot set
+            if (aligned)
+            {
+                aligner = new trace_aligner(powers_new[0]);
+                align(*aligner, powers_new, lags);
+            }
+            
+            trace_matrix pilot;
+            size_t length = powers_new[0].size();
+            for (int j = 1; j < oracle_queries; j++)
+                length = std::min(length, powers_new[j].size());
+            pilot.reset(length);
+            for (int j = 0; j < oracle_queries; j++)
+                pilot.append(powers_new[j].data(), length);
+            powers_new.clear();
+            powers_new.shrink_to_fit();
+            
+            if (order2)
+                points = select_pairs(pilot, pairs, means, shift);
+            else
+                points = select_points(pilot, ms_new, cs_new, models);
+            if (points.empty())
+            {
+                fprintf(stderr, "power: no point of the pilot traces depends on the data\n");
+                abort();
+            }
+            power_span = points.back() + 1 + (aligned ? ALIGN_LAG : 0);
+            acc = new cpa_accumulator(order2 ? pairs.size() : points.size(), used);
+            
+            // the pilot traces at the points of interest
+            traces.reset(points.size());
+            traces.extend(oracle_queries);
+            for (int i = 0; i < points.size(); i++)
+                memcpy(traces.row(i), pilot.row(points[i]), oracle_queries * sizeof(int16_t));
+            
+            int windows = 1;
+            for (int i = 1; i < points.size(); i++)
+                windows += points[i] != points[i - 1] + 1;
+            printf("Points of interest: %d in %d windows, up to sample %d of %d\n",
+                   (int) points.size(), windows, points.back() + 1, (int) length);
+            if (order2)
+                printf("Pairs of points: %d, at most %d samples apart, products shifted by %d\n",
+                       (int) pairs.size(), ORDER2_WINDOW, shift);
+        }
+        else
+        {
+            traces.extend(oracle_queries);
+            trace_sink sink = { &traces, &points, aligned ? aligner : NULL };
+            interact(ms_new, sink, first, cs_new, lags);
+        }
+        
+        if (aligned)
+        {
+            lag_min = std::min(lag_min, *std::min_element(lags.begin(), lags.end()));
+            lag_max = std::max(lag_max, *std::max_element(lags.begin(), lags.end()));
+        }
+        
+        if (order2)
+        {
+            combine_pairs(traces, first, pairs, means, shift, products);
+            acc->fold(products, 0, ms_new, cs_new);
+        }
+        else
+            acc->fold(traces, first, ms_new, cs_new);
+        
+        // the last message and its ciphertext are used for the key check
+        m = ms_new.back();
+        c = cs_new.back();
+        
+        // recover 1 byte of the key at the time: 
+        // 1 byte of the key corresponds to 1 byte of the data in AES
+        // there are 256 possible values for this byte
+        acc->best_correlations(models, peaks);
+        
+        // the models most likely to have the key within reach first
+        vector<key_ranking> rankings(models.size());
+        vector<int> order(models.size());
+        for (int l = 0; l < models.size(); l++)
+        {
+            rank_keys(peaks[l].data(), acc->count, rankings[l]);
+            order[l] = l;
+        }
+        std::sort(order.begin(), order.end(), [&rankings](int a, int b) { return rankings[a].log2_rank < rankings[b].log2_rank; });
+        
+        for (int o = 0; o < models.size() && !found; o++)
+        {
+            int l = order[o];
+            const key_ranking &r = rankings[l];
+            
+            double margin = 1;
+            for (int n = 0; n < 16; n++)
+                margin = std::min(margin, r.margin[n]);
+            
+            // the best guesses, as a last round key for the last round models
+            cout << "\nSuggested Key: ";
+            for (int n = 0; n < 16; n++)
+                printf("%02X", r.guess[n][0]);
+            printf(" (%s, estimated rank 2^%.1f, smallest margin %.3f)", models[l].name, r.log2_rank, margin);
+            
+            // enumerate only when the key is likely to be within the budget
+            if (r.log2_rank > ENUM_LOG2_BUDGET)
+                continue;
+            
+            long tried;
+            found = enumerate_keys(r, models[l].last_round, m, c, 1L << ENUM_LOG2_BUDGET, key, tried);
+            printf("\nKey check: %ld keys enumerated", tried);
+            printf(found ? "\nAES.Enc( k, m ) == c\n" : "\nAES.Enc( k, m ) != c\n");
+        }
+        
+        if (!found)
+            printf("\nRESAMPLING\n");
+    }
+    
+    cout << "\nKey: ";
+    for (int n = 0; n < 16; n++)
+        printf("%02X", key[n]);
+    cout << "\n";
+    
+    delete acc;
+    delete aligner;
+    
+    printf("\nTraces kept: %zu of %zu points%s\n", traces.traces(), traces.points(),
+           traces.spilled() ? ", in a file mapping" : "");
+    if (aligned)
+        printf("Alignment: lags from %d to %d\n", lag_min, lag_max);
+    cout << "Number of interactions with the target: " << target.queries() << "\n";
+    cout << "Query throughput: " << target.throughput() << " queries/s\n\n";
 
-	// Forcibly terminate the attacker process.
-	exit(1); 
 }
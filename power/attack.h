@@ -11,7 +11,19 @@
 #include  <gmpxx.h>
 #include  <fstream>
 #include  <algorithm>
-#include  <openssl/aes.h>
+#include  <vector>
+#include  <array>
+#include  <queue>
+#include  <cmath>
+#include  <complex>
+#include  <thread>
 #include  <X11/Xlib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include  <immintrin.h>
+#endif
+
+#include  "oracle.h"
+#include  "trace.h"
+#include  "aes.h"
 
 #endif
\ No newline at end of file
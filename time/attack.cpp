@@ -3,78 +3,79 @@
 
 using namespace std;
 
-pid_t pid = 0;    // process ID (of either parent or child) from fork
+// protocol of the target *****.D
+// send a ciphertext
+// get the execution time and the decrypted message
+struct target_codec
+{
+    struct request  { mpz_class c; };
+    struct response { int time; mpz_class m; };
+    
+    static void write(FILE* in, const request &q)
+    {
+        gmp_fprintf(in, "%0256ZX\n", q.c.get_mpz_t());
+    }
+    
+    static void read(target_t &target, response &r)
+    {
+        gmp_fscanf(target.target_out, "%d\n%ZX", &r.time, r.m.get_mpz_t());
+    }
+    
+    // trace records: the ciphertext, the message and the execution time
+    static trace_layout layout(const response &r)
+    {
+        return { 128, 128, 0 };
+    }
+    
+    static void save(const request &q, unsigned char* input)
+    {
+        trace_export(input, 128, q.c);
+    }
+    
+    static void save(const response &r, const trace_record &rec)
+    {
+        trace_export(rec.output, 128, r.m);
+        *rec.value = r.time;
+    }
+    
+    static void load(const trace_record &rec, response &r)
+    {
+        trace_import(r.m, rec.output, 128);
+        r.time = *rec.value;
+    }
+};
 
-int target_raw[2];   // unbuffered communication: attacker -> attack target
-int attack_raw[2];   // unbuffered communication: attack target -> attacker
+// protocol of the target replica *****.R
+// send a ciphertext, a modulus and a private key
+// get the execution time and the decrypted message
+struct replica_codec
+{
+    struct request  { mpz_class c, N, d; };
+    typedef target_codec::response response;
+    
+    static void write(FILE* in, const request &q)
+    {
+        gmp_fprintf(in, "%0256ZX\n%0256ZX\n%0256ZX\n", q.c.get_mpz_t(), q.N.get_mpz_t(), q.d.get_mpz_t());
+    }
+    
+    static void read(target_t &target, response &r)
+    {
+        target_codec::read(target, r);
+    }
+};
+
+oracle<target_codec>  target;
+oracle<replica_codec> replica;
 
-FILE* target_out = NULL; // buffered attack target input  stream
-FILE* target_in  = NULL; // buffered attack target output stream
+// capture replayed and capture recorded (-r and -w)
+trace_store replayed, recorded;
 
-int interact(mpz_class &c, mpz_class &m, unsigned int &interaction_number);
 void attack(char* argv2);
 void attackR(char* argv2);
-void cleanup(int s);
 
 int main(int argc, char* argv[])
 {
-
-	// Ensure we clean-up correctly if Control-C (or similar) is signalled.
-  	signal(SIGINT, &cleanup);
-
-	// Create pipes to/from attack target; if it fails the reason is stored
-	// in errno, but we'll just abort.
-	if(pipe(target_raw) == -1)
-		abort();
-	  
-	if(pipe(attack_raw) == -1)
-		abort();
-
-	switch(pid = fork()) 
-	{ 
-	    case -1: 
-			// The fork failed; reason is stored in errno, but we'll just abort.
-			abort();
-
-	    case +0: 
-	    {
-			// (Re)connect standard input and output to pipes.
-			close(STDOUT_FILENO);
-			if(dup2(attack_raw[1], STDOUT_FILENO) == -1)
-				abort();
-
-			close(STDIN_FILENO);
-			if(dup2(target_raw[0], STDIN_FILENO) == -1)
-				abort();
-
-			// Produce a sub-process representing the attack target.
-			execl(argv[1], argv[0], NULL);
-
-			// Break and clean-up once finished.
-			break;
-	    }
-
-	    default:
-	    {
-			// Construct handles to attack target standard input and output.
-			if((target_out = fdopen(attack_raw[0], "r")) == NULL) 
-				abort();
-
-			if((target_in = fdopen(target_raw[1], "w")) == NULL)
-				abort();
-
-			// Execute a function representing the attacker.
-			attack(argv[2]);
-
-			// Break and clean-up once finished.
-			break;
-	    }
-	}
-
-	// Clean up any resources we've hung on to.
-	cleanup(SIGINT);
-
-	return 0;
+	return oracle_main(argc, argv, &attack);
 }
 
 // Montgomery multiplication
@@ -177,6 +178,253 @@ void montgomery_reduction(mpz_class &rop, mpz_class t, mp_limb_t omega, mpz_clas
     mpz_swap(rop.get_mpz_t(), r.get_mpz_t()); // mpz_swap is O(1), while mpz_set is O(n) where n is the number of limbs
 }
 
+////////////////////////////////////////////////////////
+// Fixed-width Montgomery arithmetic                  //
+////////////////////////////////////////////////////////
+
+// the target works with a 1024-bit modulus, l_N = 1024/w limbs
+#define MONT_BITS  1024
+#define MONT_LIMBS (MONT_BITS / GMP_NUMB_BITS)
+
+// a number modulo N held directly in limbs, least significant limb first
+// (no heap allocation, unlike mpz_class)
+struct mont_num
+{
+    mp_limb_t limb[MONT_LIMBS];
+};
+
+// convert an mpz integer (< b^l_N) into limbs
+void mont_from_mpz(mont_num &rop, const mpz_class &num)
+{
+    memset(rop.limb, 0, sizeof(rop.limb));
+    mpz_export(rop.limb, NULL, -1, sizeof(mp_limb_t), 0, 0, num.get_mpz_t());
+}
+
+// Montgomery multiplication on limbs: r <- x*y/rho (mod N)
+// the product is formed with mpn_mul_n/mpn_sqr and then reduced one
+// limb at a time; the carries of each row are parked in the limb that
+// has just been cleared and added back in at the end
+// returns true if the result had to be reduced (r >= N), in which case
+// N is subtracted until r < N - i.e. the behaviour of
+//     x = montgomery_multiplication(x, y, omega, N);
+//     if (x >= N) x = x % N;
+// which is exactly what the attack needs to bucket the samples
+// r may alias x and/or y
+bool mont_mul(mont_num &r, const mont_num &x, const mont_num &y, mp_limb_t omega, const mont_num &N)
+{
+    mp_limb_t t[2 * MONT_LIMBS];
+
+    // t <- x*y
+    if (&x == &y)
+        mpn_sqr(t, x.limb, MONT_LIMBS);
+    else
+        mpn_mul_n(t, x.limb, y.limb, MONT_LIMBS);
+
+    // t <- t + u*N*(b^i), clearing the i-th limb each time
+    for (mp_size_t i = 0; i < MONT_LIMBS; i++)
+    {
+        // u <- t_i*omega (mod b)
+        mp_limb_t u = t[i] * omega;
+        t[i] = mpn_addmul_1(t + i, N.limb, MONT_LIMBS, u);
+    }
+
+    // r <- t / b^(l_N), i.e. upper half plus the parked carries
+    mp_limb_t carry = mpn_add_n(r.limb, t + MONT_LIMBS, t, MONT_LIMBS);
+
+    // if r >= N, r <- r - N
+    bool reduced = false;
+    while (carry || mpn_cmp(r.limb, N.limb, MONT_LIMBS) >= 0)
+    {
+        carry -= mpn_sub_n(r.limb, r.limb, N.limb, MONT_LIMBS);
+        reduced = true;
+    }
+
+    return reduced;
+}
+
+// number of levels of partial exponentiations kept around; the attack
+// only ever backtracks a few bits, older levels are overwritten
+#define MONT_LEVELS 8
+
+// every this many bits a copy of the level is kept as a checkpoint,
+// so that the attack can resume from it after resampling
+#define MONT_CHECKPOINT_BITS 8
+
+// at most this many checkpoints are kept, so that their memory does not
+// grow with the length of the key: once they are all in use, taking a
+// new one drops an older one, thinning them out geometrically with the
+// distance from the newest
+#define MONT_CHECKPOINTS 6
+
+// contiguous samples x limbs matrix of Montgomery numbers, with every
+// row starting on a cache line
+class mont_matrix
+{
+    mont_num* rows;
+    size_t rows_num, capacity;
+    
+    // the storage is owned, copying is not allowed
+    mont_matrix(const mont_matrix&);
+    mont_matrix& operator=(const mont_matrix&);
+    
+public:
+    mont_matrix() : rows(NULL), rows_num(0), capacity(0) {}
+    ~mont_matrix() { free(rows); }
+    
+    size_t size() const { return rows_num; }
+    mont_num& operator[](size_t j) { return rows[j]; }
+    const mont_num& operator[](size_t j) const { return rows[j]; }
+    
+    // change the number of rows, keeping the existing ones
+    void resize(size_t n)
+    {
+        if (n > capacity)
+        {
+            size_t new_capacity = max(n, 2 * capacity);
+            void* new_rows;
+            if (posix_memalign(&new_rows, 64, new_capacity * sizeof(mont_num)) != 0)
+                abort();
+            if (rows_num != 0)
+                memcpy(new_rows, rows, rows_num * sizeof(mont_num));
+            free(rows);
+            rows = (mont_num*) new_rows;
+            capacity = new_capacity;
+        }
+        rows_num = n;
+    }
+    
+    // make this matrix a copy of another one
+    void assign(const mont_matrix &other)
+    {
+        resize(other.size());
+        if (rows_num != 0)
+            memcpy(rows, other.rows, rows_num * sizeof(mont_num));
+    }
+};
+
+// one level of partial exponentiations for all samples
+struct mont_level
+{
+    mont_matrix sq;     // will be used when previous d_i = 0
+    mont_matrix mul_sq; // will be used when previous d_i = 1
+    int bit;            // the bit held by this level, -1 if none
+    
+    mont_level() : bit(-1) {}
+    
+    // make this level a copy of another one
+    void assign(const mont_level &other)
+    {
+        sq.assign(other.sq);
+        mul_sq.assign(other.mul_sq);
+        bit = other.bit;
+    }
+};
+
+// compute the level of partial exponentiations for the given bit
+// for the samples [from, cs.size()), by replaying the bits of d before it
+// - used to start the attack (bit 0, all samples) and to bring samples
+// acquired since a level was computed up to that level
+void mont_replay_level(mont_level &level, const mont_matrix &cs, const vector<bool> &d, int bit, int from,
+                       mp_limb_t omega, const mont_num &N)
+{
+    level.sq.resize(cs.size());
+    level.mul_sq.resize(cs.size());
+    level.bit = bit;
+    
+    #pragma omp parallel for schedule(static)
+    for (int j = from; j < cs.size(); j++)
+    {
+        // first level: d starts with a 1, c^2
+        if (bit == 0)
+        {
+            memset(level.sq[j].limb, 0, sizeof(level.sq[j].limb));
+            mont_mul(level.mul_sq[j], cs[j], cs[j], omega, N);
+            continue;
+        }
+        
+        // x <- partial exponentiation for d_0 ... d_(bit-1)
+        mont_num x;
+        mont_mul(x, cs[j], cs[j], omega, N);
+        for (int i = 1; i < bit; i++)
+        {
+            // MULTIPLY
+            if (d[i])
+                mont_mul(x, x, cs[j], omega, N);
+            // SQUARE
+            mont_mul(x, x, x, omega, N);
+        }
+        
+        // both cases for the current bit
+        mont_mul(level.sq[j], x, x, omega, N);
+        mont_mul(x, x, cs[j], omega, N);
+        mont_mul(level.mul_sq[j], x, x, omega, N);
+    }
+}
+
+// the checkpoint held for the given bit, NULL if there is none
+mont_level* mont_find_checkpoint(vector<mont_level> &checkpoints, int bit)
+{
+    for (int k = 0; k < checkpoints.size(); k++)
+        if (checkpoints[k].bit == bit)
+            return &checkpoints[k];
+    return NULL;
+}
+
+// keep a copy of level as a checkpoint
+void mont_keep_checkpoint(vector<mont_level> &checkpoints, const mont_level &level)
+{
+    // a free slot, or the one already holding this bit
+    int slot = -1;
+    for (int k = 0; k < checkpoints.size() && slot == -1; k++)
+        if (checkpoints[k].bit == -1 || checkpoints[k].bit == level.bit)
+            slot = k;
+    
+    // otherwise drop the checkpoint leaving the smallest gap relative
+    // to its distance from the new one; the oldest one is always kept
+    if (slot == -1)
+    {
+        vector<int> order(checkpoints.size());
+        for (int k = 0; k < order.size(); k++)
+            order[k] = k;
+        sort(order.begin(), order.end(), [&](int a, int b) { return checkpoints[a].bit < checkpoints[b].bit; });
+        
+        double best = 0;
+        for (int i = 1; i < order.size(); i++)
+        {
+            int next = i + 1 < order.size() ? checkpoints[order[i+1]].bit : level.bit;
+            double score = (double) (next - checkpoints[order[i-1]].bit) / (level.bit - checkpoints[order[i]].bit);
+            if (slot == -1 || score < best)
+            {
+                slot = order[i];
+                best = score;
+            }
+        }
+    }
+    
+    checkpoints[slot].assign(level);
+}
+
+// make level hold the partial exponentiations for the given bit and
+// all samples, either from the level itself or from its checkpoint;
+// samples acquired since then are brought up to the bit by replaying d
+// returns false if neither holds the bit any more
+bool mont_restore_level(mont_level &level, vector<mont_level> &checkpoints, int bit,
+                        const mont_matrix &cs, const vector<bool> &d, mp_limb_t omega, const mont_num &N)
+{
+    if (level.bit != bit)
+    {
+        mont_level* checkpoint = mont_find_checkpoint(checkpoints, bit);
+        if (checkpoint == NULL)
+            return false;
+        level.assign(*checkpoint);
+    }
+    
+    if (level.sq.size() != cs.size())
+        mont_replay_level(level, cs, d, bit, level.sq.size(), omega, N);
+    
+    return true;
+}
+
 // Convert vector of bools to a number
 mpz_class vec_to_num(const vector<bool> &d)
 {
@@ -187,7 +435,7 @@ mpz_class vec_to_num(const vector<bool> &d)
 }
 
 // check whether the recovered key is the actual private key
-bool verify(const mpz_class &e, const mpz_class &N, const mpz_class &sk, unsigned int &interaction_number,
+bool verify(const mpz_class &e, const mpz_class &N, const mpz_class &sk,
             const mpz_class &c, mpz_class &m_prime)
 {
     // m_prime holds the decrypted by the oracle message
@@ -207,17 +455,31 @@ bool verify(const mpz_class &e, const mpz_class &N, const mpz_class &sk, unsigne
 // interacts with the target *****.D
 // send a ciphertext
 // get the decrypted message and the execution time
-int interact(mpz_class &c, mpz_class &m, unsigned int &interaction_number)
+int interact(const mpz_class &c, mpz_class &m)
+{
+    target_codec::response r = target.query({ c });
+    m = r.m;
+    return r.time;
+}
+
+// interacts with the pool of targets *****.D for a batch of ciphertexts
+// get the decrypted messages and the execution times in query order
+void interact(const vector<mpz_class> &cs, vector<mpz_class> &ms, vector<int> &times)
 {
-    // interact with 61061.D
-	gmp_fprintf(target_in, "%0256ZX\n", c.get_mpz_t());
-	fflush(target_in);
-    
-    // get execution time
-	int time;
-	gmp_fscanf(target_out, "%d\n%ZX", &time, m.get_mpz_t());
-    interaction_number++;
-    return time;
+    vector<target_codec::request> qs(cs.size());
+    for (int j = 0; j < cs.size(); j++)
+        qs[j].c = cs[j];
+    
+    vector<target_codec::response> rs;
+    target.query(qs, rs);
+    
+    ms.resize(cs.size());
+    times.resize(cs.size());
+    for (int j = 0; j < cs.size(); j++)
+    {
+        times[j] = rs[j].time;
+        ms[j] = rs[j].m;
+    }
 }
 
 // interacts with the target replica *****.R
@@ -226,13 +488,33 @@ int interact(mpz_class &c, mpz_class &m, unsigned int &interaction_number)
 int calibrate(mpz_class &c, mpz_class &N, mpz_class &d, mpz_class &m)
 {
     // interact with 61061.R
-	gmp_fprintf(target_in, "%0256ZX\n%0256ZX\n%0256ZX\n", c.get_mpz_t(), N.get_mpz_t(), d.get_mpz_t());
-	fflush(target_in);
-    
-    // get execution time
-	int time;
-	gmp_fscanf(target_out, "%d\n%ZX", &time, m.get_mpz_t());
-    return time;
+    replica_codec::response r = replica.query({ c, N, d });
+    m = r.m;
+    return r.time;
+}
+
+// obtain num more samples from the target: random ciphertexts,
+// converted to Montgomery numbers for the target simulation,
+// and the time needed to decrypt them
+void sample(int num, gmp_randclass &randomness, const mpz_class &N, const mpz_class &rho_sq, mp_limb_t omega,
+            mont_matrix &cs, vector<int> &times)
+{
+    // compute random ciphertexts
+    vector<mpz_class> cs_new(num), ms_new;
+    for (int j = 0; j < num; j++)
+        cs_new[j] = randomness.get_z_range(N);
+    
+    // find the time needed to decrypt them
+    vector<int> times_new;
+    interact(cs_new, ms_new, times_new);
+    
+    // save the ciphertexts as montgomery numbers
+    // and their execution times
+    size_t old_num = cs.size();
+    cs.resize(old_num + num);
+    for (int j = 0; j < num; j++)
+        mont_from_mpz(cs[old_num + j], montgomery_number(cs_new[j], rho_sq, omega, N));
+    times.insert(times.end(), times_new.begin(), times_new.end());
 }
 
 // test function to obtain times for different key from
@@ -307,9 +589,6 @@ void attackR(char* argv2)
 // called from main
 void attack(char* argv2)
 {
-    // count the number of interactions with the target
-    unsigned int interaction_number = 0;
-    
     // count the number of resamples
     unsigned int resamples = 0;
     
@@ -319,9 +598,12 @@ void attack(char* argv2)
 	mpz_class N, e;
 	config >> hex >> N >> e;
     
+    // record the queries to the target or replay them
+    trace_attach(target, replayed, recorded);
+    
     // initialise verification variables
     mpz_class c_vrfy = 0b1010, m_vrfy;
-    interact(c_vrfy, m_vrfy, interaction_number); 
+    interact(c_vrfy, m_vrfy); 
     // decrypt the ciphertext with the oracle
     
     // execution times for the initial sample set of ciphertexts
@@ -329,7 +611,6 @@ void attack(char* argv2)
     
     // declare variables for communication with the target
     mpz_class c = 0, m;
-    int time_c = 0;
     
     // time it takes to do a single Montgomery multiplication
     // got from 61061.R
@@ -337,7 +618,7 @@ void attack(char* argv2)
     
     // get execution time: time it takes the targer to decrypt 
     // a ciphertext with the private key we aim to recover
-    int time_ex = interact(c, m, interaction_number);
+    int time_ex = interact(c, m);
     
     // No of (bits in key + hamming weight)
     int bits_num = (time_ex - time_overhead)/time_op;
@@ -345,9 +626,12 @@ void attack(char* argv2)
     // for each bit = 0 recovered, 1 will be subtracted,
     // for each bit = 1 recovered, 2 will be subtracted
     
-    // vectors of ciphertexts
-    vector<mpz_class> cs;
-    vector<vector<mpz_class>> part_cs_mul_sq(bits_num), part_cs_sq(bits_num);
+    // matrix of ciphertexts
+    mont_matrix cs;
+    
+    // partial exponentiations: the levels for the last MONT_LEVELS bits,
+    // the level of bit i is held in levels[i % MONT_LEVELS]
+    mont_level levels[MONT_LEVELS];
     
     // produce random ciphertexts
     gmp_randclass randomness (gmp_randinit_default);
@@ -358,6 +642,15 @@ void attack(char* argv2)
     montgomery_omega(omega, N);
     montgomery_rho_sq(rho_sq, N);
     
+    // the simulation works on fixed-width limbs
+    if (mpz_size(N.get_mpz_t()) != MONT_LIMBS)
+    {
+        cout << "Error: N is not a " << MONT_BITS << "-bit modulus\n";
+        return;
+    }
+    mont_num N_mont;
+    mont_from_mpz(N_mont, N);
+    
     // d is the private key
     vector<bool> d;
     
@@ -365,28 +658,10 @@ void attack(char* argv2)
     int oracle_queries = 2000;
     
     // initial sample set and respective execution times
-    for (int j = 0; j < oracle_queries; j++)
-    {
-        // compute a random ciphertext
-        c = randomness.get_z_range(N);
-        // find the time needed to decrypt it
-        time_c = interact(c, m, interaction_number);
-        
-        // convert the ciphertext to a montgomery number
-        // for the target simulation
-        c = montgomery_number(c, rho_sq, omega, N);
-        // save the current ciphertext
-        cs.push_back(c);
-        // and its execution time
-        times.push_back(time_c);
-        
-        // compute the square
-        c = montgomery_multiplication(c, c, omega, N);
-        
-        // vectors for partial exponentiations
-        part_cs_mul_sq[0].push_back(c); // will be used when previous d_i = 1
-        part_cs_sq[0].push_back(0);     // will be used when previous d_i = 0
-    }
+    sample(oracle_queries, randomness, N, rho_sq, omega, cs, times);
+    
+    // partial exponentiations for the first bit
+    mont_replay_level(levels[0], cs, d, 0, 0, omega, N_mont);
    
     ////////////////////////////////////////////////////////
     // ATTACK                                             //
@@ -402,6 +677,17 @@ void attack(char* argv2)
     int bit_i = 0, backtracks = 0;
     vector<bool> isFlipped(bits_num, false);
     
+    // checkpoints of some of the MONT_CHECKPOINT_BITS-th levels
+    vector<mont_level> checkpoints(MONT_CHECKPOINTS);
+    
+    // confidence measure each bit was predicted with (0 if flipped)
+    // when resampling, the bits are kept as long as the average confidence
+    // over confident_window bits is at least confident_measure;
+    // last_resume_bit is where the attack resumed from the last time
+    vector<long long> confidence(bits_num, 0);
+    long long confident_measure = 25;
+    int confident_window = 4, last_resume_bit = 0;
+    
     // mpz integer to hold the private key once recovered
     mpz_class sk;
     
@@ -410,41 +696,68 @@ void attack(char* argv2)
     {
         // each time the program needs to backtrack too many times
         // additional 250 random ciphertexts are generated
-        // and the key is attacked from the beginning
+        // and the attack resumes after the bits predicted with high
+        // confidence, replaying them for the new ciphertexts only;
+        // if it has not got past the bit it resumed from last time,
+        // the key is attacked from the beginning
         if (doResample)
         {
             // add 250 more samples
             cout << "RESAMPLING\n";
-            for (int j = 0; j < 250; j++)
+            sample(250, randomness, N, rho_sq, omega, cs, times);
+            oracle_queries += 250; // update the counter
+            
+            // once a bit is wrong the following predictions are close
+            // to random: find where the average confidence drops
+            int trusted_bit = 0;
+            for (int k = 1; k <= bit_i; k++)
             {
-                // compute a random ciphertext
-                c = randomness.get_z_range(N);
-                // find the time needed to decrypt it
-                time_c = interact(c, m, interaction_number);
-                
-                // convert the ciphertext to a montgomery number
-                // for the target simulation
-                c = montgomery_number(c, rho_sq, omega, N);
-                // save the current ciphertext
-                cs.push_back(c);
-                // and its execution time
-                times.push_back(time_c);
-                
-                // compute the square
-                c = montgomery_multiplication(c, c, omega, N);
-                
-                // vectors for partial exponentiations
-                part_cs_mul_sq[0].push_back(c); // will be used when previous d_i = 1
-                part_cs_sq[0].push_back(0);     // will be used when previous d_i = 0
+                int from = max(1, k - confident_window + 1);
+                long long sum = 0;
+                for (int l = from; l <= k; l++)
+                    sum += confidence[l];
+                if (sum < confident_measure * (k - from + 1))
+                    break;
+                trusted_bit = k;
             }
-
-            // clear all variables and start guessing the key again
-            oracle_queries += 250; // update the counter
-            fill(isFlipped.begin(), isFlipped.end(), false); // flipped bits vector
-            bit_i = 0; // bit counter
+            
+            // resume confident_window bits before that, from the last bit
+            // whose partial exponentiations are still held
+            int resume_bit = 0;
+            for (int k = 1; k <= trusted_bit - confident_window; k++)
+                if (levels[k % MONT_LEVELS].bit == k || mont_find_checkpoint(checkpoints, k) != NULL)
+                    resume_bit = k;
+            
+            // no progress since the last resample: start again
+            if (resume_bit <= last_resume_bit)
+                resume_bit = 0;
+            last_resume_bit = resume_bit;
+            
+            // keep the guesses up to the resume bit
+            d.resize(resume_bit + 1);
             bits_num = (time_ex - time_overhead)/time_op - 2; // -2 as d starts with a 1
-            d.clear(); // clear all guesses
-            d.push_back(1); // push first bit 1
+            for (int i = 1; i < d.size(); i++)
+                bits_num -= d[i] + 1;
+            
+            // bring the partial exponentiations of the resume bit up to
+            // date: only the new samples are replayed when resuming
+            mont_level &resume_level = levels[resume_bit % MONT_LEVELS];
+            if (resume_bit == 0)
+                mont_replay_level(resume_level, cs, d, 0, 0, omega, N_mont);
+            else
+                mont_restore_level(resume_level, checkpoints, resume_bit, cs, d, omega, N_mont);
+            
+            // the levels after it are recomputed as the attack goes
+            for (int l = 0; l < MONT_LEVELS; l++)
+                if (&levels[l] != &resume_level)
+                    levels[l].bit = -1;
+            for (int k = 0; k < checkpoints.size(); k++)
+                if (checkpoints[k].bit > resume_bit)
+                    checkpoints[k].bit = -1;
+            
+            // clear the rest of the variables and carry on guessing the key
+            fill(isFlipped.begin(), isFlipped.end(), false); // flipped bits vector
+            bit_i = resume_bit; // bit counter
             doResample = false;
             backtracks = 0;
         }
@@ -452,6 +765,20 @@ void attack(char* argv2)
         // keep track of the bit we are recovering
         bit_i++;
         
+        // the partial exponentiations of the previous bit and the ones
+        // being computed for this bit
+        mont_level &prev_level = levels[(bit_i-1) % MONT_LEVELS];
+        mont_level &level = levels[bit_i % MONT_LEVELS];
+        
+        // backtracked further than the levels kept and there is no
+        // checkpoint for it either: treat it like reaching the beginning of d
+        if (!mont_restore_level(prev_level, checkpoints, bit_i-1, cs, d, omega, N_mont))
+        {
+            bit_i--;
+            doResample = true;
+            continue;
+        }
+        
         /////////////////////////////////////////////////////////////
         // confidence measures - average calculations for hypotheses
         // case for bit is 1
@@ -464,11 +791,23 @@ void attack(char* argv2)
         long long time0 = 0, time0red = 0;
         int time0_count = 0, time0red_count = 0; // counters
 
+        // make room for the partial exponentiations of this level,
+        // so that the samples can be simulated independently
+        level.sq.resize(oracle_queries);
+        level.mul_sq.resize(oracle_queries);
+        level.bit = bit_i;
+        
         // for each sample ciphertext
+        // every thread sums its own share of the samples; the sums are
+        // integers, so merging them gives the same result for any number
+        // of threads
+        #pragma omp parallel for schedule(static) \
+                reduction(+:time0, time0red, time0_count, time0red_count, \
+                            time1, time1red, time1_count, time1red_count)
         for (int j = 0; j < oracle_queries; j++)
         {
             // x is the current calculation, prev_x is the previous calculation
-            mpz_class x, prev_x;
+            mont_num x, prev_x;
             
             // obtain the time it took to decrypt the current
             // ciphertext with the target
@@ -476,9 +815,9 @@ void attack(char* argv2)
             
             // get partial exponentiation based on previous bit
             if (d.back() == 0)
-                prev_x = part_cs_sq[bit_i-1][j];
+                prev_x = prev_level.sq[j];
             else
-                prev_x = part_cs_mul_sq[bit_i-1][j];
+                prev_x = prev_level.mul_sq[j];
             
             
             //////////////////////////////////////////////////////
@@ -486,12 +825,9 @@ void attack(char* argv2)
             // d_i = 0
             
             // SQUARE
-            x = montgomery_multiplication(prev_x,prev_x,omega,N);
-            
             // MODULAR REDUCTION
-            if (x >= N)
+            if (mont_mul(x,prev_x,prev_x,omega,N_mont))
             {
-                x = x % N;
                 time0red += current_time; // add the current time to the sum
                 time0red_count++; // increment counter
             }
@@ -501,11 +837,8 @@ void attack(char* argv2)
                 time0_count++; // increment counter
             }
             
-            // insert or update the partial exponentiation for the case d_i = 0
-            if(part_cs_sq[bit_i].size() <= j)
-                part_cs_sq[bit_i].push_back(x);
-            else
-                part_cs_sq[bit_i][j] = x;
+            // update the partial exponentiation for the case d_i = 0
+            level.sq[j] = x;
             
             
             //////////////////////////////////////////////////////
@@ -513,19 +846,13 @@ void attack(char* argv2)
             // d_i = 1
             
             // MULTIPLY
-            x = montgomery_multiplication(prev_x,cs[j],omega,N);
-            
             //MODULAR REDUCTION
-            if (x >= N)
-                x = x % N;
+            mont_mul(x,prev_x,cs[j],omega,N_mont);
             
             // SQUARE
-            x = montgomery_multiplication(x,x,omega,N);
-            
             //MODULAR REDUCTION
-            if (x >= N)
+            if (mont_mul(x,x,x,omega,N_mont))
             {
-                x = x % N;
                 time1red += current_time; // add the current time to the sum
                 time1red_count++; // increment counter
             }
@@ -535,13 +862,14 @@ void attack(char* argv2)
                 time1_count++; // increment counter
             }
             
-            // insert or update the partial exponentiation for the case d_i = 1
-            if(part_cs_mul_sq[bit_i].size() <= j)
-                part_cs_mul_sq[bit_i].push_back(x);
-            else
-                part_cs_mul_sq[bit_i][j] = x;   
+            // update the partial exponentiation for the case d_i = 1
+            level.mul_sq[j] = x;
         }
         
+        // keep a checkpoint of this level
+        if (bit_i % MONT_CHECKPOINT_BITS == 0)
+            mont_keep_checkpoint(checkpoints, level);
+        
         // ensure no division by 0 is done
         // and average the values for all cases
         if (time1_count != 0)
@@ -562,6 +890,7 @@ void attack(char* argv2)
         {
             // check which bit should be predicted based on confidence measures
             // and update the number of bits left to recover (bits_num)
+            confidence[bit_i] = abs(abs(time1-time1red) - abs(time0-time0red));
             if (abs(time1-time1red) > abs(time0-time0red))
             {
                 // predict 1
@@ -632,6 +961,12 @@ void attack(char* argv2)
             
             // keep track of the flipped bits
             isFlipped[bit_i] = true; 
+            confidence[bit_i] = 0;
+            
+            // checkpoints after the flipped bit no longer hold
+            for (int k = 0; k < checkpoints.size(); k++)
+                if (checkpoints[k].bit > bit_i)
+                    checkpoints[k].bit = -1;
         }
         
         // check if we have recovered the full private key
@@ -640,7 +975,7 @@ void attack(char* argv2)
             // convert the vector of bits to an mpz integer
             sk = vec_to_num(d);
             // check if it's the right private key
-            isKey = verify(e, N, sk, interaction_number, c_vrfy, m_vrfy);
+            isKey = verify(e, N, sk, c_vrfy, m_vrfy);
         }
     }
     
@@ -650,27 +985,9 @@ void attack(char* argv2)
     
     cout << "\nd = " << hex << uppercase << sk;
     
-    cout << "\nInteractions: " << dec << interaction_number << "\n";
+    cout << "\nInteractions: " << dec << target.queries() << "\n";
+    cout << "Mean query latency: " << target.latency() * 1e6 << " us\n";
+    cout << "Query throughput: " << target.throughput() << " queries/s\n";
     
 }
 
-
-void cleanup(int s) 
-{
-	// Close the   buffered communication handles.
-	fclose(target_in);
-	fclose(target_out);
-
-	// Close the unbuffered communication handles.
-	close(target_raw[0]); 
-	close(target_raw[1]); 
-	close(attack_raw[0]); 
-	close(attack_raw[1]); 
-
-	// Forcibly terminate the attack target process.
-	if( pid > 0 )
-		kill(pid, SIGKILL);
-
-	// Forcibly terminate the attacker process.
-	exit(1); 
-}
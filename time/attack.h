@@ -10,9 +10,14 @@
 #include  <fcntl.h>
 #include  <gmpxx.h>
 #include  <fstream>
+#include  <vector>
+#include  <thread>
 #include  <openssl/sha.h>
 #include  <openssl/evp.h>
 #include  <openssl/rsa.h>
 #include  <X11/Xlib.h>
 
+#include  "oracle.h"
+#include  "trace.h"
+
 #endif
\ No newline at end of file